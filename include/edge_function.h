@@ -0,0 +1,83 @@
+/**
+ * @file edge_function.h
+ * @author Mao Zhang (mao.zhang233@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef SOFTWARE_RENDERER_INCLUDE_EDGE_FUNCTION_H_
+#define SOFTWARE_RENDERER_INCLUDE_EDGE_FUNCTION_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+#include "simd.h"
+#include "utils.h"
+
+namespace swr {
+
+// Sub-pixel precision of the fixed-point rasterizer
+const int SUBPIXEL_BITS = 8;
+const int SUBPIXEL_ONE = 1 << SUBPIXEL_BITS;
+
+// Block origins of the SIMD rasterizer are saturated to this magnitude
+// before the lane offsets are added in 32 bits
+const int64_t SIMD_EDGE_SATURATION = int64_t{1} << 30;
+
+// Fixed-point edge function a * x + b * y + c in sub-pixel units, positive
+// inside the triangle, biased by the top-left fill rule
+struct EdgeFunction {
+  int64_t a;
+  int64_t b;
+  int64_t c;
+};
+
+// Snap vertices to sub-pixel grid and setup the edge functions, area is
+// twice the snapped area, returns false beyond fixed-point range
+bool SetupEdgeFunctions(const Vec3f* screen_coords, EdgeFunction* edges,
+                        int64_t& area);
+
+// Value at the center of pixel x, y
+inline int64_t EvaluateEdge(const EdgeFunction& edge, int x, int y) {
+  return edge.a * (static_cast<int64_t>(x) << SUBPIXEL_BITS) +
+         edge.b * (static_cast<int64_t>(y) << SUBPIXEL_BITS) + edge.c;
+}
+
+// Whether the SIMD rasterizer evaluates the edge exactly in sign: every lane
+// offset stays below the saturation, so a saturated origin plus an offset
+// keeps the sign of the exact value and never overflows 32 bits
+inline bool IsSimdEdge(const EdgeFunction& edge) {
+  int64_t max_offset = ((simd::BLOCK_WIDTH - 1) * std::abs(edge.a) +
+                        (simd::BLOCK_HEIGHT - 1) * std::abs(edge.b))
+                       << SUBPIXEL_BITS;
+  return max_offset < SIMD_EDGE_SATURATION;
+}
+
+// Offsets of the lanes of a block from its origin, for a SIMD edge
+inline simd::Int EdgeLaneOffsets(const EdgeFunction& edge) {
+  int lane_offsets[simd::LANES];
+  for (int lane = 0; lane < simd::LANES; ++lane) {
+    lane_offsets[lane] = static_cast<int>(
+        ((lane % simd::BLOCK_WIDTH) * edge.a +
+         (lane / simd::BLOCK_WIDTH) * edge.b)
+        << SUBPIXEL_BITS);
+  }
+  return simd::Load(lane_offsets);
+}
+
+// Values of a SIMD edge at the lanes of the block at x, y, exact in sign
+inline simd::Int EvaluateEdgeBlock(const EdgeFunction& edge,
+                                   const simd::Int& lane_offsets, int x,
+                                   int y) {
+  int64_t w = std::clamp(EvaluateEdge(edge, x, y), -SIMD_EDGE_SATURATION,
+                         SIMD_EDGE_SATURATION);
+  return simd::Set(static_cast<int>(w)) + lane_offsets;
+}
+
+}  // namespace swr
+
+#endif  // SOFTWARE_RENDERER_INCLUDE_EDGE_FUNCTION_H_
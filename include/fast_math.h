@@ -0,0 +1,94 @@
+/**
+ * @file fast_math.h
+ * @author Mao Zhang (mao.zhang233@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef SOFTWARE_RENDERER_INCLUDE_FAST_MATH_H_
+#define SOFTWARE_RENDERER_INCLUDE_FAST_MATH_H_
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "simd.h"
+#include "utils.h"
+
+namespace swr {
+
+// Math of the shading stage, shaders are instantiated once per precision
+// tier and pick it up at compile time
+
+// Full precision sqrt, divide and pow
+struct ExactMath {
+  static inline float Pow32(float x) { return std::pow(x, 32.f); }
+  // No vector pow, std::pow per lane so the batched shaders have an exact
+  // reference too
+  static inline simd::Float Pow32(simd::Float x) {
+    float lanes[simd::LANES];
+    simd::Store(lanes, x);
+    for (int i = 0; i < simd::LANES; ++i) {
+      lanes[i] = std::pow(lanes[i], 32.f);
+    }
+    return simd::Load(lanes);
+  }
+
+  static inline float Log2(float x) { return std::log2(x); }
+
+  static inline Vec3f Normalize(Vec3f v) { return v.Normalize(); }
+  static inline simd::Vec3 Normalize(const simd::Vec3& v) {
+    return simd::Normalize(v);
+  }
+};
+
+// Approximate tier for previews: integer power specular and reciprocal
+// square root estimates refined by one Newton step
+struct FastMath {
+  static inline float Pow32(float x) {
+    for (int i = 0; i < 5; ++i) {
+      x *= x;
+    }
+    return x;
+  }
+  static inline simd::Float Pow32(simd::Float x) {
+    for (int i = 0; i < 5; ++i) {
+      x = x * x;
+    }
+    return x;
+  }
+
+  // Exponent plus linear mantissa, within .09 of log2, enough to pick mip
+  // levels
+  static inline float Log2(float x) {
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    return static_cast<float>(bits) * (1.f / (1 << 23)) - 127.f;
+  }
+
+  static inline float Rsqrt(float x) {
+    // Initial estimate from the exponent bits
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    bits = 0x5f375a86u - (bits >> 1);
+    float y;
+    std::memcpy(&y, &bits, sizeof(y));
+
+    return y * (1.5f - .5f * x * y * y);
+  }
+  static inline simd::Float Rsqrt(simd::Float x) {
+    simd::Float y = simd::Rsqrt(x);
+    return y * (simd::Set(1.5f) - simd::Set(.5f) * x * y * y);
+  }
+
+  static inline Vec3f Normalize(const Vec3f& v) { return v * Rsqrt(v * v); }
+  static inline simd::Vec3 Normalize(const simd::Vec3& v) {
+    return v * Rsqrt(simd::Dot(v, v));
+  }
+};
+
+}  // namespace swr
+
+#endif  // SOFTWARE_RENDERER_INCLUDE_FAST_MATH_H_
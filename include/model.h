@@ -29,6 +29,10 @@ class Model {
   Vec2f GetTextureCoords(int index) const;
   std::vector<int> GetNormalIndices(int index) const;
   Vec3f GetNormalCoords(int index) const;
+  std::vector<int> GetTangentIndices(int index) const;
+  // Unit tangent orthogonal to the normal, w is the handedness of the
+  // bitangent, cross(normal, tangent) * w
+  Vec4f GetTangent(int index) const;
 
  private:
   std::vector<Vec3f> vertices_;
@@ -37,6 +41,12 @@ class Model {
   std::vector<Vec2f> texture_coords_;
   std::vector<std::vector<int> > normal_indices_;
   std::vector<Vec3f> normal_coords_;
+  std::vector<std::vector<int> > tangent_indices_;
+  std::vector<Vec4f> tangents_;
+
+  // Smoothed tangent frames, one per distinct pair of normal and texture
+  // coordinates so that mirrored uv seams keep their own handedness
+  void ComputeTangents();
 };
 }  // namespace swr
 
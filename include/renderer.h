@@ -10,20 +10,207 @@
  */
 #ifndef SOFTWARE_RENDERER_INCLUDE_RENDERER_H_
 #define SOFTWARE_RENDERER_INCLUDE_RENDERER_H_
+#include <cstdint>
 #include <string>
 #include <vector>
 
+#include "edge_function.h"
 #include "image.h"
 #include "layer.h"
 #include "model.h"
 #include "shader.h"
 #include "texture.h"
+#include "thread_pool.h"
 #include "utils.h"
+#include "virtual_texture.h"
 
 namespace swr {
 
+// Screen tile edge length in pixels for binning
+const int TILE_SIZE = 64;
+
+// Block edge length in pixels for hierarchical traversal
+const int RASTER_BLOCK_SIZE = 8;
+
+// Relative error of depth interpolated in float, kept as margin when
+// comparing against the hierarchical z-buffer
+const float HIZ_TOLERANCE = 4e-6f;
+
+// Pages cached per virtual texture, 4 MB of RGBA8, and pages streamed in per
+// texture after each frame
+const int VIRTUAL_CACHE_PAGES = 64;
+const int VIRTUAL_PAGES_PER_FRAME = 16;
+
+// Page files of virtual textures are baked into this directory of the
+// working directory, away from the assets
+const char VIRTUAL_PAGE_DIRECTORY[] = "virtual_pages";
+
+enum ERasterizer {
+  BARYCENTRIC_RASTERIZER,
+  EDGE_FUNCTION_RASTERIZER,
+  SIMD_RASTERIZER
+};
+
+// Forward shades every fragment passing the running depth test, visibility
+// buffer rasterizes triangle ids first and shades each pixel once
+enum ERenderPath { FORWARD_RENDER_PATH, VISIBILITY_BUFFER_RENDER_PATH };
+
+// Math tier of the shaders, see fast_math.h
+enum EPrecision { EXACT_PRECISION, FAST_PRECISION };
+
+// Per-channel RGB error of the fast tier against the exact one, the mean is
+// over pixels covered in either image
+struct PrecisionError {
+  int max[3];
+  float mean[3];
+};
+
+// Edge length in texels of the shadow map of the main light
+const int SHADOW_MAP_SIZE = 2048;
+
+// Depth offset of shadow casters against self-shadowing: constant, and per
+// texel of depth slope
+const float SHADOW_BIAS = 2e-5f;
+const float SHADOW_SLOPE_BIAS = 1.5f;
+
+// Pixels beyond each side of the surface that the fixed-point rasterizer
+// accepts before triangles get clipped
+const float GUARD_BAND = 8192.f;
+
+enum ClipPlane {
+  LEFT_PLANE,
+  RIGHT_PLANE,
+  BOTTOM_PLANE,
+  TOP_PLANE,
+  NEAR_PLANE,
+  FAR_PLANE,
+  LEFT_GUARD_PLANE,
+  RIGHT_GUARD_PLANE,
+  BOTTOM_GUARD_PLANE,
+  TOP_GUARD_PLANE,
+  CLIP_PLANES_COUNT
+};
+
+// Vertex after the vertex shader, in clip coordinates with w > 0 in front of
+// the camera
+struct ClipVertex {
+  Vec4f position;
+  Varyings varyings;
+};
+
+// Attribute plane in screen space, relative to the first vertex of triangle
+struct Plane {
+  float origin;
+  float dx;
+  float dy;
+
+  inline float At(float x, float y) const { return origin + dx * x + dy * y; }
+};
+
+// Triangle output by the vertex stage
+struct Triangle {
+  Vec3f screen_coords[3];
+  float inverse_w[3];
+  int x_min;
+  int y_min;
+  int x_max;
+  int y_max;
+  // edges[i] is opposite to vertex i
+  EdgeFunction edges[3];
+  // Screen space depth, 1 / w and every varying divided by w
+  Plane depth;
+  Plane inverse_w_plane;
+  Plane varyings[VARYINGS_COUNT];
+  bool fixed_point;
+  // Outside the view frustum, or clipped away entirely
+  bool rejected;
+  // Back facing or degenerate
+  bool culled;
+  // Next triangle clipped from the same face, -1 if none
+  int next;
+};
+
+// Shadow caster of the depth-only pass, in shadow map coordinates, the
+// bounds are clamped to the map
+struct DepthTriangle {
+  Vec3f screen_coords[3];
+  int x_min;
+  int y_min;
+  int x_max;
+  int y_max;
+  EdgeFunction edges[3];
+  // Biased away from the light
+  Plane depth;
+  // Behind the light, back facing, degenerate or off the map
+  bool culled;
+};
+
+// Screen tile with the triangles overlapping it in submission order, bounds
+// are inclusive
+struct Tile {
+  int x_min;
+  int y_min;
+  int x_max;
+  int y_max;
+  // Farthest z index written in tile, a lower bound of its z-buffer
+  int hiz;
+  // Fast clear state, clear values are written when the tile is next drawn:
+  // surface color written since its last clear, and surface depth cleared
+  // but not written yet
+  bool color_dirty;
+  bool depth_clear_pending;
+  // Screen depth range of the triangles binned to tile, empty if none
+  float z_min;
+  float z_max;
+  std::vector<int> triangles;
+  // Point lights whose bounds overlap the tile and its depth range
+  std::vector<int> lights;
+};
+
+// Screen space bounds of a point light, the rectangle is inclusive
+struct LightBounds {
+  int x_min;
+  int y_min;
+  int x_max;
+  int y_max;
+  float z_min;
+  float z_max;
+};
+
+// Color and depth the rasterizer writes to, either the whole surface or a
+// tile-local buffer, addressed in screen coordinates
+struct RenderTarget {
+  // Pixel at x_origin, y_origin
+  uint32_t* color;
+  int* depth;
+  int x_origin;
+  int y_origin;
+  // Negative for the surface, whose rows are stored bottom-up
+  int color_stride;
+  int depth_stride;
+
+  inline uint32_t& Color(int x, int y) const {
+    return color[x - x_origin + (y - y_origin) * color_stride];
+  }
+  inline int& Depth(int x, int y) const {
+    return depth[x - x_origin + (y - y_origin) * depth_stride];
+  }
+};
+
+// Per-thread color and depth of a single tile, small enough to stay in cache
+struct TileBuffer {
+  uint32_t color[TILE_SIZE * TILE_SIZE];
+  int depth[TILE_SIZE * TILE_SIZE];
+};
+
 class Renderer : public Layer {
  public:
+  // Vertex and raster stages specialized for one shader type
+  using VertexPipeline = void (Renderer::*)(int face, Triangle& triangle,
+                                            std::vector<Triangle>& clipped);
+  using TilePipeline = void (Renderer::*)(Tile& tile,
+                                          const RenderTarget& target);
+
   Renderer() = delete;
   Renderer(VkPhysicalDevice& physical_device, VkDevice& device,
            VkQueue& graphics_queue, VkCommandPool& command_pool);
@@ -35,11 +222,121 @@ class Renderer : public Layer {
 
   void LoadModel(const std::string& filename);
   void LoadTexture(int type, const std::string& filename);
+  // Interleave the diffuse, tangent space normal and specular textures,
+  // none for virtual textures whose texels are not all in memory
+  void BuildMaterialTexture();
+  // Decode the normal textures to unit vectors, none for compressed or
+  // virtual textures
+  void BuildNormalMaps();
+  // Reload every texture in the current modes and rebuild what derives from
+  // them
+  void ReloadTextures();
 
-  void DrawTriangle(std::vector<Vec3f>& screen_coords,
-                    std::vector<Vec3f>& vertex_coords,
-                    std::vector<Vec3f>& normal_coords,
-                    std::vector<Vec2f>& texture_coords);
+  // Point lights shaded on top of the main light, culled per tile
+  void AddLight(const PointLight& light);
+  void ClearLights();
+
+  // Render every shading mode with both precision tiers and compare them,
+  // results are indexed by shading mode
+  void MeasurePrecisionError();
+
+  // Vertex stage for a single face, triangles clipped from it beyond the
+  // first are appended to clipped and linked from triangle
+  template <typename ShaderT>
+  void ProcessVertices(int face, Triangle& triangle,
+                       std::vector<Triangle>& clipped);
+  // Perspective division and setup for rasterization
+  void SetupTriangle(const ClipVertex* vertices, Triangle& triangle);
+  // Bin triangles into the screen tiles they overlap
+  void BinTriangles();
+  // Build the light list of every tile from the light bounds and the depth
+  // range of the tile
+  void CullLights();
+  // Screen bounds of light, the whole surface if it reaches behind the eye
+  LightBounds GetLightBounds(const PointLight& light) const;
+  // Render the depth of the model seen from the main light, skipped while
+  // the light and the model are unchanged
+  void UpdateShadowMap(const Vec3f& light);
+  // Transform and setup a face for the depth-only pass
+  void SetupDepthTriangle(int face, DepthTriangle& triangle) const;
+  // Depth-only raster of the rows y_min to y_max of triangle, no varyings,
+  // shading or color
+  void RasterizeDepth(const DepthTriangle& triangle, int y_min, int y_max);
+
+  // Clear color and depth in O(tiles), the clear values are materialized
+  // lazily per tile by ClearTileColor and ClearTileDepth
+  void Clear();
+  void ClearTileColor(Tile& tile);
+  void ClearTileDepth(Tile& tile);
+  // Mark every block of tile as empty in the hierarchical z-buffer
+  void ResetHiZ(Tile& tile);
+  // Clear the tile-local buffer and bind it to tile
+  RenderTarget BeginTile(Tile& tile, TileBuffer& buffer);
+  // Write the color of a tile-local target back to the surface
+  void EndTile(const Tile& tile, const RenderTarget& target);
+  // Raster stage of a tile specialized for a shader type
+  template <typename ShaderT>
+  void DrawTile(Tile& tile, const RenderTarget& target);
+  // Rasterize the part of triangle inside tile, skipping the parts hidden
+  // according to the hierarchical z-buffer. Lights are those of tile, down
+  // to the shaders
+  template <typename ShaderT>
+  void DrawTriangle(const Triangle& triangle, Tile& tile,
+                    const LightList& lights, const RenderTarget& target);
+  // Per-pixel barycentric reference rasterizer
+  template <typename ShaderT>
+  void RasterizeBarycentric(const Triangle& triangle, int x_min, int y_min,
+                            int x_max, int y_max, const LightList& lights,
+                            const RenderTarget& target);
+  // Incremental fixed-point edge function rasterizer, covered skips the
+  // edge tests for rectangles known to lie inside the triangle, returns
+  // whether any pixel was written
+  template <typename ShaderT>
+  bool RasterizeEdgeFunction(const Triangle& triangle, int x_min, int y_min,
+                             int x_max, int y_max, bool covered,
+                             const LightList& lights,
+                             const RenderTarget& target);
+  // Coverage and depth test for a block of quads per step, x_min and y_min
+  // are aligned to quad blocks inside tile, returns whether any pixel was
+  // written
+  template <typename ShaderT>
+  bool RasterizeSimd(const Triangle& triangle, const Tile& tile, int x_min,
+                     int y_min, int x_max, int y_max, bool covered,
+                     const LightList& lights, const RenderTarget& target);
+  // Depth test and shade a covered pixel, returns whether it passed
+  template <typename ShaderT>
+  bool DrawFragment(const Triangle& triangle, int x, int y, int z,
+                    const LightList& lights, const RenderTarget& target);
+  // Shade a pixel which passed depth test, or record its triangle in the
+  // visibility buffer
+  template <typename ShaderT>
+  void WriteFragment(const Triangle& triangle, int x, int y,
+                     const LightList& lights, const RenderTarget& target);
+  // Shade every pixel of tile recorded in the visibility buffer
+  template <typename ShaderT>
+  void ResolveVisibility(const Tile& tile, const RenderTarget& target);
+  // Interpolate varyings with perspective correction and shade a pixel which
+  // passed depth test
+  template <typename ShaderT>
+  void ShadeFragment(const Triangle& triangle, int x, int y,
+                     const LightList& lights, const RenderTarget& target);
+  // Shade the lanes in mask of the simd block at x and y at once
+  template <typename ShaderT>
+  void ShadeBlock(const Triangle& triangle, int x, int y, int mask,
+                  const LightList& lights, const RenderTarget& target);
+  // Varyings of triangle at a pixel, with perspective correction
+  static void InterpolateVaryings(const Triangle& triangle, int x, int y,
+                                  Varyings& varyings);
+  // uv derivatives of the 2x2 quad holding the pixel at x and y
+  static void InterpolateUvDerivatives(const Triangle& triangle, int x, int y,
+                                       UvDerivatives& derivatives);
+  // Nearest z index of the depth plane over a rectangle, in float
+  static float NearestDepth(const Triangle& triangle, int x_min, int y_min,
+                            int x_max, int y_max);
+  // Refresh the hierarchical z-buffer entry of the block at block_x and
+  // block_y from the z-buffer
+  void UpdateHiZ(int block_x, int block_y, const Tile& tile,
+                 const RenderTarget& target);
   // Bresenham's line algorithm
   void DrawLine(int x0, int y0, int x1, int y1, uint32_t pixel);
 
@@ -48,7 +345,14 @@ class Renderer : public Layer {
 
   static bool InsideTriangle(int x, int y, Vec2i& v0, Vec2i& v1, Vec2i& v2);
   // Barycentric Coordinates
-  static Vec3f Barycentric(float x, float y, Vec3f& v0, Vec3f& v1, Vec3f& v2);
+  static Vec3f Barycentric(float x, float y, const Vec3f& v0, const Vec3f& v1,
+                           const Vec3f& v2);
+  // Snap triangle to sub-pixel grid and setup its edge functions
+  static void SetupEdgeFunctions(Triangle& triangle);
+  // Setup screen space planes of depth, 1 / w and varyings
+  static void SetupPlanes(const ClipVertex* vertices, Triangle& triangle);
+  // Signed distance to a clipping plane, positive inside
+  float ClipDistance(const Vec4f& position, int plane) const;
 
   // RGB to RGBA in hexadecimal
   static uint32_t GetColor(const Vec3f& color);
@@ -61,11 +365,38 @@ class Renderer : public Layer {
   Image* surface_ = nullptr;
   Model* model_;
   std::vector<int>* zbuffer_ = nullptr;
+  // Farthest z index of every RASTER_BLOCK_SIZE block, row-major
+  std::vector<int> hiz_;
+  int hiz_width_ = 0;
+  // Index into triangles_ of the visible triangle per pixel, -1 if none
+  std::vector<int> visibility_;
+  // Indexed by thread, used when tile buffers are enabled
+  std::vector<TileBuffer> tile_buffers_;
   Texture* diffuse_texture_ = nullptr;
   Texture* normal_texture_ = nullptr;
   Texture* normal_tangent_texture_ = nullptr;
   Texture* specular_texture_ = nullptr;
-  Shader* shader_;
+  // Interleaved from the textures above, built while enabled
+  MaterialTexture* material_texture_ = nullptr;
+  // Decoded from the normal textures, built while enabled
+  NormalMap* normal_map_ = nullptr;
+  NormalMap* normal_tangent_map_ = nullptr;
+  Uniforms uniforms_;
+  std::vector<PointLight> lights_;
+  std::vector<LightBounds> light_bounds_;
+  // Largest depth seen from the main light per texel, row-major, -FLT_MAX
+  // where nothing casts a shadow
+  std::vector<float> shadow_map_;
+  std::vector<DepthTriangle> shadow_triangles_;
+  Mat4 shadow_mvp_;
+  // Light and model the shadow map is valid for
+  Vec3f shadow_light_;
+  const Model* shadow_model_ = nullptr;
+
+  ThreadPool* thread_pool_ = nullptr;
+  std::vector<Triangle> triangles_;
+  std::vector<std::vector<Triangle> > clipped_triangles_;
+  std::vector<Tile> tiles_;
 
   VkPhysicalDevice& physical_device_;
   VkDevice& device_;
@@ -78,6 +409,35 @@ class Renderer : public Layer {
   int primitive_mode_ = 1;
   int pre_shading_mode = 2;
   int shading_mode_ = 2;
+  int thread_count_ = 1;
+  int pre_point_lights_count_ = 0;
+  int point_lights_count_ = 0;
+  int pre_rasterizer_ = ERasterizer::SIMD_RASTERIZER;
+  int rasterizer_ = ERasterizer::SIMD_RASTERIZER;
+  int pre_render_path_ = ERenderPath::FORWARD_RENDER_PATH;
+  int render_path_ = ERenderPath::FORWARD_RENDER_PATH;
+  int pre_precision_ = EPrecision::EXACT_PRECISION;
+  int precision_ = EPrecision::EXACT_PRECISION;
+  std::vector<PrecisionError> precision_errors_;
+  // Rasterizer, render path, shaders and filter the errors were measured on
+  std::string precision_paths_;
+  int pre_texture_filter_ = ETextureFilter::NEAREST_FILTER;
+  int texture_filter_ = ETextureFilter::NEAREST_FILTER;
+  bool enable_hiz_ = true;
+  bool pre_enable_tile_buffers_ = false;
+  bool enable_tile_buffers_ = false;
+  bool pre_enable_tiled_textures_ = false;
+  bool enable_tiled_textures_ = false;
+  bool pre_enable_compressed_textures_ = false;
+  bool enable_compressed_textures_ = false;
+  bool pre_enable_material_texture_ = false;
+  bool enable_material_texture_ = false;
+  bool pre_enable_virtual_textures_ = false;
+  bool enable_virtual_textures_ = false;
+  bool pre_enable_decoded_normals_ = true;
+  bool enable_decoded_normals_ = true;
+  bool pre_enable_shadows_ = true;
+  bool enable_shadows_ = true;
   bool need_reset_ = false;
 };
 }  // namespace swr
@@ -10,17 +10,18 @@
  */
 #ifndef SOFTWARE_RENDERER_INCLUDE_SHADER_H_
 #define SOFTWARE_RENDERER_INCLUDE_SHADER_H_
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
 #include <vector>
 
+#include "fast_math.h"
+#include "simd.h"
 #include "texture.h"
 #include "utils.h"
 
 namespace swr {
 
-enum Matrix { MVP };
-
-enum Vector { VERTEX, FRAGMENT, LIGHT, EYE, NORMAL, TANGENT, BITANGENT };
-
 enum ETexture {
   DIFFUSE_TEXTURE,
   NORMAL_TEXTURE,
@@ -28,56 +29,260 @@ enum ETexture {
   SPECULAR_TEXTURE
 };
 
+// Point light in world space, its contribution fades out to zero at radius
+struct PointLight {
+  Vec3f position;
+  Vec3f color;
+  float radius;
+};
+
+// Per-draw constants, immutable while drawing and shared read-only by every
+// thread
+struct Uniforms {
+  Mat4 mvp;
+  // Main light, unattenuated
+  Vec3f light;
+  Vec3f eye;
+  // Point lights of the scene, shaders only read the ones in their LightList
+  const PointLight* lights;
+  // Depth seen from the main light, row-major, null when shadows are off
+  const float* shadow_map;
+  int shadow_map_size;
+  // World to shadow map coordinates, depth in [0, 1] and larger is nearer
+  Mat4 shadow_mvp;
+  Texture* diffuse_texture;
+  Texture* normal_texture;
+  Texture* normal_tangent_texture;
+  Texture* specular_texture;
+  // Unit vectors decoded from normal_texture and normal_tangent_texture,
+  // null when off
+  const NormalMap* normal_map;
+  const NormalMap* normal_tangent_map;
+  // Diffuse, tangent space normal and specular interleaved, sampled by
+  // normal mapping in place of the three textures, null when off
+  const MaterialTexture* material_texture;
+  // ETextureFilter of every texture
+  int texture_filter;
+};
+
+// Vertex stage input
+struct Attributes {
+  Vec3f vertex;
+  Vec3f normal;
+  // w is the handedness of the bitangent
+  Vec4f tangent;
+  Vec2f texture;
+};
+
+// Indices into Uniforms::lights of the point lights reaching a screen tile
+struct LightList {
+  const int* indices;
+  int count;
+};
+
+// Vertex stage output interpolated across the triangle, made of floats only
+// so that the rasterizer interpolates every member the same way
+struct Varyings {
+  Vec3f position;
+  Vec3f normal;
+  // World space tangent frame for point lights under normal mapping
+  Vec3f tangent;
+  float handedness;
+  // Towards the light and the eye, unnormalized, in the space the shader
+  // lights in: world space, or tangent space for normal mapping
+  Vec3f light_dir;
+  Vec3f view_dir;
+  Vec2f uv;
+  // Clip coordinates from the main light, w > 0 in front of it
+  Vec4f shadow_position;
+};
+
+const int VARYINGS_COUNT = sizeof(Varyings) / sizeof(float);
+static_assert(sizeof(Varyings) == VARYINGS_COUNT * sizeof(float),
+              "Varyings must be tightly packed floats");
+static_assert(std::is_trivially_copyable<Varyings>::value,
+              "Varyings must be plain old data");
+
+// Index of uv.u among the floats of Varyings
+const int UV_VARYING = offsetof(Varyings, uv) / sizeof(float);
+
+// Varyings of simd::LANES fragments as structures of arrays, members in the
+// same order as Varyings
+struct VaryingsBatch {
+  simd::Vec3 position;
+  simd::Vec3 normal;
+  simd::Vec3 tangent;
+  simd::Float handedness;
+  simd::Vec3 light_dir;
+  simd::Vec3 view_dir;
+  simd::Vec2 uv;
+  simd::Vec4 shadow_position;
+};
+
+static_assert(sizeof(VaryingsBatch) == VARYINGS_COUNT * sizeof(simd::Float),
+              "VaryingsBatch must mirror Varyings");
+
+// Screen space derivatives of uv, taken across the 2x2 quad of a fragment
+// and shared by its four pixels, they select the mip level
+struct UvDerivatives {
+  Vec2f dx;
+  Vec2f dy;
+};
+
+// Per lane, equal within each quad of the block
+struct UvDerivativesBatch {
+  simd::Vec2 dx;
+  simd::Vec2 dy;
+};
+
+// Maps of a material texel, diffuse and specular in the scale of texture
+// samples, [0, 255], and a unit normal
+struct MaterialSample {
+  Vec3f diffuse;
+  Vec3f normal;
+  Vec3f specular;
+};
+
+struct MaterialSampleBatch {
+  simd::Vec3 diffuse;
+  simd::Vec3 normal;
+  simd::Vec3 specular;
+};
+
+// Shaders are stateless and bound at compile time by the raster pipeline,
+// derived shaders hide the stages they replace. MathT is the precision tier,
+// ExactMath or FastMath, both instantiated in shader.cc
+template <typename MathT>
 class Shader {
  public:
-  Shader() = default;
-  virtual ~Shader() = default;
-
-  void SetVec2i(Vec2i& vec);
-  void SetVec3f(int name, Vec3f& vec);
-  void SetMat4(int type, Mat4& mat);
-  void SetTexture(int name, Texture* texture);
-
-  virtual void Vertex(Vec3f& position);
-  virtual void Fragment(uint32_t& pixel);
-
- protected:
-  Vec2i uv_;
-  Vec3f eye_;
-  Vec3f light_;
-  Vec3f fragment_;
-  Vec3f vertex_;
-  Vec3f normal_;
-  Vec3f tangent_;
-  Vec3f bitangent_;
-  Mat4 mvp_;
-  Texture* diffuse_texture_;
-  Texture* normal_texture_;
-  Texture* normal_tangent_texture_;
-  Texture* specular_texture_;
+  // Outputs clip coordinates, divided by w in the renderer
+  static void Vertex(const Uniforms& uniforms, const Attributes& attributes,
+                     Vec4f& position, Varyings& varyings);
+  static void Fragment(const Uniforms& uniforms, const Varyings& varyings,
+                       const UvDerivatives& derivatives,
+                       const LightList& lights, uint32_t& pixel);
+  // Shade simd::LANES fragments at once, lanes outside mask are not sampled
+  // and their pixels are undefined
+  static void FragmentBatch(const Uniforms& uniforms,
+                            const VaryingsBatch& varyings,
+                            const UvDerivativesBatch& derivatives,
+                            const LightList& lights, int mask,
+                            simd::Int& pixels);
 };
 
-class PhongShader : public Shader {
+template <typename MathT>
+class PhongShader : public Shader<MathT> {
  public:
-  PhongShader() = default;
-  virtual ~PhongShader() = default;
-
-  void Fragment(uint32_t& pixel) override;
+  static void Fragment(const Uniforms& uniforms, const Varyings& varyings,
+                       const UvDerivatives& derivatives,
+                       const LightList& lights, uint32_t& pixel);
+  static void FragmentBatch(const Uniforms& uniforms,
+                            const VaryingsBatch& varyings,
+                            const UvDerivativesBatch& derivatives,
+                            const LightList& lights, int mask,
+                            simd::Int& pixels);
 };
 
-class NormalMappingShader : public Shader {
+template <typename MathT>
+class NormalMappingShader : public Shader<MathT> {
  public:
-  NormalMappingShader() = default;
-  virtual ~NormalMappingShader() = default;
-
-  void Fragment(uint32_t& pixel) override;
+  // Light and view vectors leave in tangent space
+  static void Vertex(const Uniforms& uniforms, const Attributes& attributes,
+                     Vec4f& position, Varyings& varyings);
+  static void Fragment(const Uniforms& uniforms, const Varyings& varyings,
+                       const UvDerivatives& derivatives,
+                       const LightList& lights, uint32_t& pixel);
+  static void FragmentBatch(const Uniforms& uniforms,
+                            const VaryingsBatch& varyings,
+                            const UvDerivativesBatch& derivatives,
+                            const LightList& lights, int mask,
+                            simd::Int& pixels);
 };
 
+// Texel coordinates of uv in texture
+Vec2i TexelCoords(const Texture* texture, const Vec2f& uv);
+// Texel coordinates of the lanes in mask
+void TexelCoords(const Texture* texture, const simd::Vec2& uv, int mask,
+                 int* u, int* v);
+
 Vec3f Sample(Texture* surface, int x, int y);
 
-Vec3f Reflect(Vec3f& v, Vec3f& normal);
+// Texels of the lanes in mask, zero elsewhere
+simd::Vec3 Sample(Texture* surface, const int* x, const int* y, int mask);
+
+// Texel at uv filtered by uniforms.texture_filter, clamped to the edges
+template <typename MathT>
+Vec3f Sample(const Uniforms& uniforms, Texture* texture, const Vec2f& uv,
+             const UvDerivatives& derivatives);
+template <typename MathT>
+simd::Vec3 Sample(const Uniforms& uniforms, Texture* texture,
+                  const simd::Vec2& uv, const UvDerivativesBatch& derivatives,
+                  int mask);
+
+// Unit normal at uv from map, or from the texels of texture when map is null,
+// filtered by uniforms.texture_filter
+template <typename MathT>
+Vec3f SampleNormal(const Uniforms& uniforms, Texture* texture,
+                   const NormalMap* map, const Vec2f& uv,
+                   const UvDerivatives& derivatives);
+template <typename MathT>
+simd::Vec3 SampleNormal(const Uniforms& uniforms, Texture* texture,
+                        const NormalMap* map, const simd::Vec2& uv,
+                        const UvDerivativesBatch& derivatives, int mask);
+
+// Every map of material at uv with one fetch per texel, filtered by
+// uniforms.texture_filter like Sample
+template <typename MathT>
+MaterialSample SampleMaterial(const Uniforms& uniforms,
+                              const MaterialTexture* material,
+                              const Vec2f& uv,
+                              const UvDerivatives& derivatives);
+template <typename MathT>
+MaterialSampleBatch SampleMaterial(const Uniforms& uniforms,
+                                   const MaterialTexture* material,
+                                   const simd::Vec2& uv,
+                                   const UvDerivativesBatch& derivatives,
+                                   int mask);
+
+// Bilinear texel of a mip level at uv
+Vec3f SampleBilinear(const MipLevel& level, const Vec2f& uv);
+// Bilinear texels of an uncompressed mip level per lane, gathered and
+// filtered with 8-bit fixed point weights, clamped to the edges for every
+// lane
+simd::Vec3 SampleBilinear(const MipLevel& level, const simd::Vec2& uv);
+
+// Mip level of texture whose texels match the pixel footprint, unclamped.
+// TextureT is Texture, MaterialTexture or NormalMap
+template <typename MathT, typename TextureT>
+float LevelOfDetail(const TextureT* texture, const UvDerivatives& derivatives);
+
+// Fraction of the main light reaching a fragment, 2x2 percentage closer
+// filtered, 1 without a shadow map
+float ShadowFactor(const Uniforms& uniforms, const Vec4f& shadow_position);
+simd::Float ShadowFactor(const Uniforms& uniforms,
+                         const simd::Vec4& shadow_position);
+
+Vec3f Reflect(const Vec3f& v, const Vec3f& normal);
+simd::Vec3 Reflect(const simd::Vec3& v, const simd::Vec3& normal);
+
+// Diffuse and specular of the point lights in lights, at a world space
+// position with unit normal and view direction
+template <typename MathT>
+Vec3f ShadePointLights(const Uniforms& uniforms, const LightList& lights,
+                       const Vec3f& position, const Vec3f& normal,
+                       const Vec3f& view_dir, const Vec3f& diffuse,
+                       const Vec3f& specular);
+template <typename MathT>
+simd::Vec3 ShadePointLights(const Uniforms& uniforms, const LightList& lights,
+                            const simd::Vec3& position,
+                            const simd::Vec3& normal,
+                            const simd::Vec3& view_dir,
+                            const simd::Vec3& diffuse,
+                            const simd::Vec3& specular);
 
+// RGBA8 with every channel saturated
 uint32_t GetColor(const Vec3f& color);
+simd::Int GetColor(const simd::Vec3& color);
 
 }  // namespace swr
 
@@ -0,0 +1,461 @@
+/**
+ * @file simd.h
+ * @author Mao Zhang (mao.zhang233@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef SOFTWARE_RENDERER_INCLUDE_SIMD_H_
+#define SOFTWARE_RENDERER_INCLUDE_SIMD_H_
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#define SOFTWARE_RENDERER_SIMD_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SOFTWARE_RENDERER_SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace swr {
+namespace simd {
+
+// Lanes are laid out as a block of two rows, LANES / 2 pixels each, so that
+// every block holds whole 2x2 quads
+#if defined(SOFTWARE_RENDERER_SIMD_AVX2)
+const int LANES = 8;
+#else
+const int LANES = 4;
+#endif
+const int BLOCK_WIDTH = LANES / 2;
+const int BLOCK_HEIGHT = 2;
+
+#if defined(SOFTWARE_RENDERER_SIMD_AVX2)
+
+struct Float {
+  __m256 v;
+};
+
+// Also used as lane mask, all bits set in active lanes
+struct Int {
+  __m256i v;
+};
+
+inline Float Set(float f) { return {_mm256_set1_ps(f)}; }
+inline Int Set(int i) { return {_mm256_set1_epi32(i)}; }
+inline Float Load(const float* p) { return {_mm256_loadu_ps(p)}; }
+inline Int Load(const int* p) {
+  return {_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))};
+}
+inline void Store(float* p, Float a) { _mm256_storeu_ps(p, a.v); }
+// p[index] per lane
+inline Float Gather(const float* p, Int index) {
+  return {_mm256_i32gather_ps(p, index.v, 4)};
+}
+inline Int Gather(const int32_t* p, Int index) {
+  return {_mm256_i32gather_epi32(reinterpret_cast<const int*>(p), index.v, 4)};
+}
+inline void Store(int* p, Int a) {
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), a.v);
+}
+inline Int LoadBlock(const int* row0, const int* row1) {
+  __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0));
+  __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1));
+  return {_mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1)};
+}
+inline void StoreBlock(int* row0, int* row1, Int a) {
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(row0),
+                   _mm256_castsi256_si128(a.v));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(row1),
+                   _mm256_extracti128_si256(a.v, 1));
+}
+
+inline Float operator+(Float a, Float b) { return {_mm256_add_ps(a.v, b.v)}; }
+inline Float operator-(Float a, Float b) { return {_mm256_sub_ps(a.v, b.v)}; }
+inline Float operator*(Float a, Float b) { return {_mm256_mul_ps(a.v, b.v)}; }
+inline Float operator/(Float a, Float b) { return {_mm256_div_ps(a.v, b.v)}; }
+inline Int operator+(Int a, Int b) { return {_mm256_add_epi32(a.v, b.v)}; }
+inline Int operator-(Int a, Int b) { return {_mm256_sub_epi32(a.v, b.v)}; }
+// Low 32 bits of the product
+inline Int operator*(Int a, Int b) { return {_mm256_mullo_epi32(a.v, b.v)}; }
+inline Int operator|(Int a, Int b) { return {_mm256_or_si256(a.v, b.v)}; }
+inline Int operator&(Int a, Int b) { return {_mm256_and_si256(a.v, b.v)}; }
+inline Int operator>(Int a, Int b) { return {_mm256_cmpgt_epi32(a.v, b.v)}; }
+inline Int operator==(Int a, Int b) { return {_mm256_cmpeq_epi32(a.v, b.v)}; }
+inline Int operator<<(Int a, int n) {
+  return {_mm256_sll_epi32(a.v, _mm_cvtsi32_si128(n))};
+}
+// Logical, zeros shifted in
+inline Int operator>>(Int a, int n) {
+  return {_mm256_srl_epi32(a.v, _mm_cvtsi32_si128(n))};
+}
+
+inline Float Min(Float a, Float b) { return {_mm256_min_ps(a.v, b.v)}; }
+inline Float Max(Float a, Float b) { return {_mm256_max_ps(a.v, b.v)}; }
+inline Float Sqrt(Float a) { return {_mm256_sqrt_ps(a.v)}; }
+// Reciprocal square root estimate, relative error below 1.5 * 2^-12
+inline Float Rsqrt(Float a) { return {_mm256_rsqrt_ps(a.v)}; }
+// 1 where x >= edge, 0 elsewhere
+inline Float Step(Float edge, Float x) {
+  return {_mm256_and_ps(_mm256_cmp_ps(x.v, edge.v, _CMP_GE_OQ),
+                        _mm256_set1_ps(1.f))};
+}
+
+inline Float ToFloat(Int a) { return {_mm256_cvtepi32_ps(a.v)}; }
+// Round to nearest
+inline Int ToInt(Float a) { return {_mm256_cvtps_epi32(a.v)}; }
+// Round toward zero
+inline Int Truncate(Float a) { return {_mm256_cvttps_epi32(a.v)}; }
+// Lanes of a where mask is set, b elsewhere
+inline Int Select(Int mask, Int a, Int b) {
+  return {_mm256_blendv_epi8(b.v, a.v, mask.v)};
+}
+inline Float Select(Int mask, Float a, Float b) {
+  return {_mm256_blendv_ps(b.v, a.v, _mm256_castsi256_ps(mask.v))};
+}
+// One bit per lane
+inline int MoveMask(Int mask) {
+  return _mm256_movemask_ps(_mm256_castsi256_ps(mask.v));
+}
+
+#elif defined(SOFTWARE_RENDERER_SIMD_SSE2)
+
+struct Float {
+  __m128 v;
+};
+
+// Also used as lane mask, all bits set in active lanes
+struct Int {
+  __m128i v;
+};
+
+inline Float Set(float f) { return {_mm_set1_ps(f)}; }
+inline Int Set(int i) { return {_mm_set1_epi32(i)}; }
+inline Float Load(const float* p) { return {_mm_loadu_ps(p)}; }
+inline Int Load(const int* p) {
+  return {_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))};
+}
+inline void Store(float* p, Float a) { _mm_storeu_ps(p, a.v); }
+// p[index] per lane, no gather instruction before AVX2
+inline Float Gather(const float* p, Int index) {
+  alignas(16) int32_t i[4];
+  _mm_store_si128(reinterpret_cast<__m128i*>(i), index.v);
+  return {_mm_setr_ps(p[i[0]], p[i[1]], p[i[2]], p[i[3]])};
+}
+inline Int Gather(const int32_t* p, Int index) {
+  alignas(16) int32_t i[4];
+  alignas(16) int32_t r[4];
+  _mm_store_si128(reinterpret_cast<__m128i*>(i), index.v);
+  for (int lane = 0; lane < 4; ++lane) {
+    std::memcpy(&r[lane], p + i[lane], sizeof(int32_t));
+  }
+  return {_mm_load_si128(reinterpret_cast<const __m128i*>(r))};
+}
+inline void Store(int* p, Int a) {
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(p), a.v);
+}
+inline Int LoadBlock(const int* row0, const int* row1) {
+  __m128i low = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(row0));
+  __m128i high = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(row1));
+  return {_mm_unpacklo_epi64(low, high)};
+}
+inline void StoreBlock(int* row0, int* row1, Int a) {
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(row0), a.v);
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(row1),
+                   _mm_unpackhi_epi64(a.v, a.v));
+}
+
+inline Float operator+(Float a, Float b) { return {_mm_add_ps(a.v, b.v)}; }
+inline Float operator-(Float a, Float b) { return {_mm_sub_ps(a.v, b.v)}; }
+inline Float operator*(Float a, Float b) { return {_mm_mul_ps(a.v, b.v)}; }
+inline Float operator/(Float a, Float b) { return {_mm_div_ps(a.v, b.v)}; }
+inline Int operator+(Int a, Int b) { return {_mm_add_epi32(a.v, b.v)}; }
+inline Int operator-(Int a, Int b) { return {_mm_sub_epi32(a.v, b.v)}; }
+// Low 32 bits of the product, from the 64-bit products of even and odd lanes
+inline Int operator*(Int a, Int b) {
+  __m128i even = _mm_mul_epu32(a.v, b.v);
+  __m128i odd =
+      _mm_mul_epu32(_mm_srli_epi64(a.v, 32), _mm_srli_epi64(b.v, 32));
+  return {_mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                             _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)))};
+}
+inline Int operator|(Int a, Int b) { return {_mm_or_si128(a.v, b.v)}; }
+inline Int operator&(Int a, Int b) { return {_mm_and_si128(a.v, b.v)}; }
+inline Int operator>(Int a, Int b) { return {_mm_cmpgt_epi32(a.v, b.v)}; }
+inline Int operator==(Int a, Int b) { return {_mm_cmpeq_epi32(a.v, b.v)}; }
+inline Int operator<<(Int a, int n) {
+  return {_mm_sll_epi32(a.v, _mm_cvtsi32_si128(n))};
+}
+// Logical, zeros shifted in
+inline Int operator>>(Int a, int n) {
+  return {_mm_srl_epi32(a.v, _mm_cvtsi32_si128(n))};
+}
+
+inline Float Min(Float a, Float b) { return {_mm_min_ps(a.v, b.v)}; }
+inline Float Max(Float a, Float b) { return {_mm_max_ps(a.v, b.v)}; }
+inline Float Sqrt(Float a) { return {_mm_sqrt_ps(a.v)}; }
+// Reciprocal square root estimate, relative error below 1.5 * 2^-12
+inline Float Rsqrt(Float a) { return {_mm_rsqrt_ps(a.v)}; }
+// 1 where x >= edge, 0 elsewhere
+inline Float Step(Float edge, Float x) {
+  return {_mm_and_ps(_mm_cmpge_ps(x.v, edge.v), _mm_set1_ps(1.f))};
+}
+
+inline Float ToFloat(Int a) { return {_mm_cvtepi32_ps(a.v)}; }
+// Round to nearest
+inline Int ToInt(Float a) { return {_mm_cvtps_epi32(a.v)}; }
+// Round toward zero
+inline Int Truncate(Float a) { return {_mm_cvttps_epi32(a.v)}; }
+// Lanes of a where mask is set, b elsewhere
+inline Int Select(Int mask, Int a, Int b) {
+  return {_mm_or_si128(_mm_and_si128(mask.v, a.v),
+                       _mm_andnot_si128(mask.v, b.v))};
+}
+inline Float Select(Int mask, Float a, Float b) {
+  __m128 m = _mm_castsi128_ps(mask.v);
+  return {_mm_or_ps(_mm_and_ps(m, a.v), _mm_andnot_ps(m, b.v))};
+}
+// One bit per lane
+inline int MoveMask(Int mask) {
+  return _mm_movemask_ps(_mm_castsi128_ps(mask.v));
+}
+
+#else
+
+// Portable fallback, plain loops the compiler is free to vectorize
+struct Float {
+  float v[LANES];
+};
+
+// Also used as lane mask, all bits set in active lanes
+struct Int {
+  int32_t v[LANES];
+};
+
+inline Float Set(float f) {
+  Float r;
+  for (int i = 0; i < LANES; ++i) r.v[i] = f;
+  return r;
+}
+inline Int Set(int n) {
+  Int r;
+  for (int i = 0; i < LANES; ++i) r.v[i] = n;
+  return r;
+}
+inline Float Load(const float* p) {
+  Float r;
+  for (int i = 0; i < LANES; ++i) r.v[i] = p[i];
+  return r;
+}
+inline Int Load(const int* p) {
+  Int r;
+  for (int i = 0; i < LANES; ++i) r.v[i] = p[i];
+  return r;
+}
+inline void Store(float* p, Float a) {
+  for (int i = 0; i < LANES; ++i) p[i] = a.v[i];
+}
+// p[index] per lane
+inline Float Gather(const float* p, Int index) {
+  Float r;
+  for (int i = 0; i < LANES; ++i) r.v[i] = p[index.v[i]];
+  return r;
+}
+inline Int Gather(const int32_t* p, Int index) {
+  Int r;
+  for (int i = 0; i < LANES; ++i) {
+    std::memcpy(&r.v[i], p + index.v[i], sizeof(int32_t));
+  }
+  return r;
+}
+inline void Store(int* p, Int a) {
+  for (int i = 0; i < LANES; ++i) p[i] = a.v[i];
+}
+inline Int LoadBlock(const int* row0, const int* row1) {
+  Int r;
+  for (int i = 0; i < BLOCK_WIDTH; ++i) {
+    r.v[i] = row0[i];
+    r.v[i + BLOCK_WIDTH] = row1[i];
+  }
+  return r;
+}
+inline void StoreBlock(int* row0, int* row1, Int a) {
+  for (int i = 0; i < BLOCK_WIDTH; ++i) {
+    row0[i] = a.v[i];
+    row1[i] = a.v[i + BLOCK_WIDTH];
+  }
+}
+
+inline Float operator+(Float a, Float b) {
+  for (int i = 0; i < LANES; ++i) a.v[i] += b.v[i];
+  return a;
+}
+inline Float operator-(Float a, Float b) {
+  for (int i = 0; i < LANES; ++i) a.v[i] -= b.v[i];
+  return a;
+}
+inline Float operator*(Float a, Float b) {
+  for (int i = 0; i < LANES; ++i) a.v[i] *= b.v[i];
+  return a;
+}
+inline Float operator/(Float a, Float b) {
+  for (int i = 0; i < LANES; ++i) a.v[i] /= b.v[i];
+  return a;
+}
+inline Int operator+(Int a, Int b) {
+  for (int i = 0; i < LANES; ++i) a.v[i] += b.v[i];
+  return a;
+}
+inline Int operator-(Int a, Int b) {
+  for (int i = 0; i < LANES; ++i) a.v[i] -= b.v[i];
+  return a;
+}
+// Low 32 bits of the product
+inline Int operator*(Int a, Int b) {
+  for (int i = 0; i < LANES; ++i) {
+    a.v[i] = static_cast<int32_t>(static_cast<uint32_t>(a.v[i]) *
+                                  static_cast<uint32_t>(b.v[i]));
+  }
+  return a;
+}
+inline Int operator|(Int a, Int b) {
+  for (int i = 0; i < LANES; ++i) a.v[i] |= b.v[i];
+  return a;
+}
+inline Int operator&(Int a, Int b) {
+  for (int i = 0; i < LANES; ++i) a.v[i] &= b.v[i];
+  return a;
+}
+inline Int operator>(Int a, Int b) {
+  for (int i = 0; i < LANES; ++i) a.v[i] = a.v[i] > b.v[i] ? -1 : 0;
+  return a;
+}
+inline Int operator==(Int a, Int b) {
+  for (int i = 0; i < LANES; ++i) a.v[i] = a.v[i] == b.v[i] ? -1 : 0;
+  return a;
+}
+inline Int operator<<(Int a, int n) {
+  for (int i = 0; i < LANES; ++i) {
+    a.v[i] = static_cast<int32_t>(static_cast<uint32_t>(a.v[i]) << n);
+  }
+  return a;
+}
+// Logical, zeros shifted in
+inline Int operator>>(Int a, int n) {
+  for (int i = 0; i < LANES; ++i) {
+    a.v[i] = static_cast<int32_t>(static_cast<uint32_t>(a.v[i]) >> n);
+  }
+  return a;
+}
+
+// b when unordered, like the SSE instructions
+inline Float Min(Float a, Float b) {
+  for (int i = 0; i < LANES; ++i) a.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i];
+  return a;
+}
+inline Float Max(Float a, Float b) {
+  for (int i = 0; i < LANES; ++i) a.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i];
+  return a;
+}
+inline Float Sqrt(Float a) {
+  for (int i = 0; i < LANES; ++i) a.v[i] = std::sqrt(a.v[i]);
+  return a;
+}
+inline Float Rsqrt(Float a) {
+  for (int i = 0; i < LANES; ++i) a.v[i] = 1.f / std::sqrt(a.v[i]);
+  return a;
+}
+// 1 where x >= edge, 0 elsewhere
+inline Float Step(Float edge, Float x) {
+  for (int i = 0; i < LANES; ++i) x.v[i] = x.v[i] >= edge.v[i] ? 1.f : 0.f;
+  return x;
+}
+
+inline Float ToFloat(Int a) {
+  Float r;
+  for (int i = 0; i < LANES; ++i) r.v[i] = static_cast<float>(a.v[i]);
+  return r;
+}
+// Round to nearest
+inline Int ToInt(Float a) {
+  Int r;
+  for (int i = 0; i < LANES; ++i) {
+    r.v[i] = static_cast<int32_t>(std::nearbyint(a.v[i]));
+  }
+  return r;
+}
+// Round toward zero
+inline Int Truncate(Float a) {
+  Int r;
+  for (int i = 0; i < LANES; ++i) r.v[i] = static_cast<int32_t>(a.v[i]);
+  return r;
+}
+// Lanes of a where mask is set, b elsewhere
+inline Int Select(Int mask, Int a, Int b) {
+  for (int i = 0; i < LANES; ++i) a.v[i] = mask.v[i] ? a.v[i] : b.v[i];
+  return a;
+}
+inline Float Select(Int mask, Float a, Float b) {
+  for (int i = 0; i < LANES; ++i) a.v[i] = mask.v[i] ? a.v[i] : b.v[i];
+  return a;
+}
+// One bit per lane
+inline int MoveMask(Int mask) {
+  int bits = 0;
+  for (int i = 0; i < LANES; ++i) bits |= (mask.v[i] < 0) << i;
+  return bits;
+}
+
+#endif
+
+// Structures of arrays holding one vector per lane
+struct Vec2 {
+  Float x;
+  Float y;
+};
+
+struct Vec3 {
+  Float x;
+  Float y;
+  Float z;
+};
+
+struct Vec4 {
+  Float x;
+  Float y;
+  Float z;
+  Float w;
+};
+
+inline Vec3 Set(float x, float y, float z) { return {Set(x), Set(y), Set(z)}; }
+inline Vec3 operator+(const Vec3& a, const Vec3& b) {
+  return {a.x + b.x, a.y + b.y, a.z + b.z};
+}
+inline Vec3 operator-(const Vec3& a, const Vec3& b) {
+  return {a.x - b.x, a.y - b.y, a.z - b.z};
+}
+inline Vec3 operator*(const Vec3& a, Float f) {
+  return {a.x * f, a.y * f, a.z * f};
+}
+inline Float Dot(const Vec3& a, const Vec3& b) {
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+inline Vec3 Cross(const Vec3& a, const Vec3& b) {
+  return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z,
+          a.x * b.y - a.y * b.x};
+}
+inline Vec3 Normalize(const Vec3& a) {
+  return a * (Set(1.f) / Sqrt(Dot(a, a)));
+}
+
+}  // namespace simd
+}  // namespace swr
+
+#endif  // SOFTWARE_RENDERER_INCLUDE_SIMD_H_
@@ -11,24 +11,204 @@
 #ifndef SOFTWARE_RENDERER_INCLUDE_TEXTURE_H_
 #define SOFTWARE_RENDERER_INCLUDE_TEXTURE_H_
 
+#include <cstddef>
 #include <cstdint>
+#include <vector>
+
+#include "utils.h"
+#include "virtual_texture.h"
 
 namespace swr {
 
+// Nearest samples the full image, bilinear filters the nearest mip level and
+// trilinear blends the two nearest levels
+enum ETextureFilter { NEAREST_FILTER, BILINEAR_FILTER, TRILINEAR_FILTER };
+
+// Linear stores rows top-down, tiled stores square tiles of texels in that
+// order so that 2D neighborhoods share cache lines
+enum ETextureLayout { LINEAR_LAYOUT, TILED_LAYOUT };
+
+// Uncompressed RGBA8, or 4x4 blocks compressed to 8 or 16 bytes:
+// BC1 RGB with a four color palette per block, BC4 one channel with eight
+// levels per block and BC5 two BC4 channels for unit vectors with z > 0
+enum ETextureFormat { RGBA8_FORMAT, BC1_FORMAT, BC4_FORMAT, BC5_FORMAT };
+
+// Edge length in texels of a tile, a tile of RGBA8 texels fills one 64 byte
+// cache line. Compressed blocks are tiles too
+const int TEXTURE_TILE_BITS = 2;
+const int TEXTURE_TILE_SIZE = 1 << TEXTURE_TILE_BITS;
+
+// Image of a mip level, tiled and compressed levels are padded to whole
+// tiles. Levels of a virtual texture hold no data, their texels are in the
+// pages of level index
+struct MipLevel {
+  int width;
+  int height;
+  uint8_t* data;
+  ETextureLayout layout;
+  ETextureFormat format;
+  int tiles_per_row;
+  const VirtualTexture* virtual_texture;
+  int index;
+
+  // RGBA8 of the texel at x and y counted from the top-left corner, valid
+  // until the next fetch of the calling thread
+  inline const uint8_t* Fetch(int x, int y) const {
+    if (virtual_texture) {
+      return virtual_texture->Fetch(index, x, y);
+    }
+    if (format == ETextureFormat::RGBA8_FORMAT) {
+      return Texel(x, y);
+    }
+    return FetchCompressed(x, y);
+  }
+  // Texels are uncompressed words in data, read through Texel
+  inline bool IsAddressable() const {
+    return format == ETextureFormat::RGBA8_FORMAT && !virtual_texture;
+  }
+  // Decode the block of the texel through a small cache of the calling
+  // thread
+  const uint8_t* FetchCompressed(int x, int y) const;
+
+  // Storage of an uncompressed texel
+  inline uint8_t* Texel(int x, int y) const {
+    if (layout == ETextureLayout::LINEAR_LAYOUT) {
+      return data + 4 * (x + y * width);
+    }
+
+    int tile = (x >> TEXTURE_TILE_BITS) +
+               (y >> TEXTURE_TILE_BITS) * tiles_per_row;
+    int texel = (x & (TEXTURE_TILE_SIZE - 1)) +
+                ((y & (TEXTURE_TILE_SIZE - 1)) << TEXTURE_TILE_BITS);
+    return data + 4 * ((tile << 2 * TEXTURE_TILE_BITS) + texel);
+  }
+};
+
 class Texture {
  public:
   Texture() = delete;
   Texture(int width, int height, uint8_t* data);
+  // Levels of virtual_texture, owned. Already mipmapped, layout and
+  // compression leave them as they are
+  explicit Texture(VirtualTexture* virtual_texture);
   ~Texture();
 
   int GetWidth() const;
   int GetHeight() const;
   uint8_t* GetData() const;
 
+  // Halve the image down to 1x1 with a box filter, level 0 is the image
+  void GenerateMipmaps();
+  int GetLevelsCount() const;
+  const MipLevel& GetLevel(int level) const;
+  // Rearrange the texels of every level, sampling through MipLevel::Texel
+  // is unaffected
+  void SetLayout(ETextureLayout layout);
+  ETextureLayout GetLayout() const;
+  // Encode every level, once, sampling through MipLevel::Fetch decodes it
+  void Compress(ETextureFormat format);
+  // Bytes held by all levels
+  size_t GetMemorySize() const;
+  // Null unless built from a virtual texture
+  VirtualTexture* GetVirtualTexture() const;
+
  private:
   int width_;
   int height_;
   uint8_t* data_;
+  // Levels beyond the first are owned
+  std::vector<MipLevel> levels_;
+  VirtualTexture* virtual_texture_ = nullptr;
+};
+
+// Diffuse, tangent space normal and specular of one texel in a single 8 byte
+// record, so a fragment reads its whole material in one fetch. Normal z is
+// left out and rebuilt from x and y, z > 0
+struct MaterialTexel {
+  uint8_t diffuse[3];
+  uint8_t normal[2];
+  uint8_t specular;
+  uint8_t padding[2];
+};
+
+static_assert(sizeof(MaterialTexel) == 8, "MaterialTexel must be 8 bytes");
+
+// Mip level of a MaterialTexture, rows top-down
+struct MaterialLevel {
+  int width;
+  int height;
+  MaterialTexel* data;
+
+  inline const MaterialTexel& Texel(int x, int y) const {
+    return data[x + y * width];
+  }
+};
+
+// Material maps interleaved per texel, mipmapped like a Texture
+class MaterialTexture {
+ public:
+  MaterialTexture() = delete;
+  // Built at the resolution of diffuse, the other maps are resampled to it
+  // when their sizes differ. Red of specular is kept
+  MaterialTexture(const Texture* diffuse, const Texture* normal_tangent,
+                  const Texture* specular);
+  ~MaterialTexture();
+
+  int GetWidth() const;
+  int GetHeight() const;
+  int GetLevelsCount() const;
+  const MaterialLevel& GetLevel(int level) const;
+  // Bytes held by all levels
+  size_t GetMemorySize() const;
+
+ private:
+  std::vector<MaterialLevel> levels_;
+};
+
+// Unit vector in 32 bits, coordinates biased to unsigned fixed point:
+// x in bits 0-10 and y in bits 11-21 as (v + 1) * 1023, z in bits 22-31 as
+// (v + 1) * 511. Rounding keeps it within 1.2e-3 of the unit vector, decoded
+// texels are used as they are
+struct NormalTexel {
+  uint32_t bits;
+};
+
+static_assert(sizeof(NormalTexel) == 4, "NormalTexel must be 4 bytes");
+
+// Fixed point scales of NormalTexel
+const int NORMAL_XY_SCALE = 1023;
+const int NORMAL_Z_SCALE = 511;
+
+// Mip level of a NormalMap, rows top-down
+struct NormalLevel {
+  int width;
+  int height;
+  NormalTexel* data;
+
+  inline const NormalTexel& Texel(int x, int y) const {
+    return data[x + y * width];
+  }
+};
+
+// Unit vectors decoded once from the texels of a normal texture, in as many
+// bytes as RGBA8. Nearest samples skip the normalization, filtered samples
+// normalize once after blending like the texture path
+class NormalMap {
+ public:
+  NormalMap() = delete;
+  // Every level of texture is decoded, fetched through MipLevel::Fetch
+  explicit NormalMap(const Texture* texture);
+  ~NormalMap();
+
+  int GetWidth() const;
+  int GetHeight() const;
+  int GetLevelsCount() const;
+  const NormalLevel& GetLevel(int level) const;
+  // Bytes held by all levels
+  size_t GetMemorySize() const;
+
+ private:
+  std::vector<NormalLevel> levels_;
 };
 
 }  // namespace swr
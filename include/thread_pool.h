@@ -0,0 +1,56 @@
+/**
+ * @file thread_pool.h
+ * @author Mao Zhang (mao.zhang233@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef SOFTWARE_RENDERER_INCLUDE_THREAD_POOL_H_
+#define SOFTWARE_RENDERER_INCLUDE_THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace swr {
+
+class ThreadPool {
+ public:
+  ThreadPool() = delete;
+  ThreadPool(int thread_count);
+  ~ThreadPool();
+
+  int GetThreadCount() const;
+
+  // Run task(index, thread) for every index in [0, count) and wait for all of
+  // them, the calling thread takes part as thread 0
+  void ParallelFor(int count, const std::function<void(int, int)>& task);
+
+ private:
+  void WorkerLoop(int thread);
+  void RunTasks(int thread);
+
+  std::vector<std::thread> workers_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+
+  const std::function<void(int, int)>* task_ = nullptr;
+  int count_ = 0;
+  std::atomic<int> next_{0};
+  int busy_ = 0;
+  uint64_t generation_ = 0;
+  bool stop_ = false;
+};
+
+}  // namespace swr
+
+#endif  // SOFTWARE_RENDERER_INCLUDE_THREAD_POOL_H_
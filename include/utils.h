@@ -308,8 +308,8 @@ struct Mat {
 #endif
 
   std::vector<float>& operator[](int index);
-  Vec3f operator*(Vec3f& v);
-  Vec4f operator*(Vec4f& v);
+  Vec3f operator*(const Vec3f& v) const;
+  Vec4f operator*(const Vec4f& v) const;
   template <int O>
   Mat<M, O> operator*(Mat<N, O> mat) const;
 
@@ -362,14 +362,14 @@ std::vector<float>& Mat<M, N>::operator[](int index) {
 }
 
 template <int M, int N>
-Vec3f Mat<M, N>::operator*(Vec3f& v) {
+Vec3f Mat<M, N>::operator*(const Vec3f& v) const {
   assert(M == 3 && N == 3);
 
   Vec3f vec{};
 
   for (int i = 0; i < M; ++i) {
     for (int j = 0; j < N; ++j) {
-      vec[i] += m[i][j] * v[j];
+      vec[i] += m[i][j] * v.raw[j];
     }
   }
 
@@ -377,14 +377,14 @@ Vec3f Mat<M, N>::operator*(Vec3f& v) {
 }
 
 template <int M, int N>
-Vec4f Mat<M, N>::operator*(Vec4f& v) {
+Vec4f Mat<M, N>::operator*(const Vec4f& v) const {
   assert(M == 4 && N == 4);
 
   Vec4f vec{};
 
   for (int i = 0; i < M; ++i) {
     for (int j = 0; j < N; ++j) {
-      vec[i] += m[i][j] * v[j];
+      vec[i] += m[i][j] * v.raw[j];
     }
   }
 
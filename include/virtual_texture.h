@@ -0,0 +1,102 @@
+/**
+ * @file virtual_texture.h
+ * @author Mao Zhang (mao.zhang233@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef SOFTWARE_RENDERER_INCLUDE_VIRTUAL_TEXTURE_H_
+#define SOFTWARE_RENDERER_INCLUDE_VIRTUAL_TEXTURE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace swr {
+
+class Texture;
+
+// Edge length in texels of a page, a page of RGBA8 texels is 64 KB
+const int VIRTUAL_PAGE_BITS = 7;
+const int VIRTUAL_PAGE_SIZE = 1 << VIRTUAL_PAGE_BITS;
+const int VIRTUAL_PAGE_BYTES = 4 * VIRTUAL_PAGE_SIZE * VIRTUAL_PAGE_SIZE;
+
+// Mip levels split into pages stored in a page file, only the pages in a
+// bounded cache are in memory. A page table maps pages to cache slots, the
+// levels that fit in one page stay resident so that every fetch resolves.
+// Fetches stamp the pages they want with the current frame, Update streams
+// in the stamped pages that are missing and evicts the least recently used
+class VirtualTexture {
+ public:
+  VirtualTexture() = delete;
+  // Page file written by WritePageFile, cache_pages pages at most
+  VirtualTexture(const std::string& filename, int cache_pages);
+  ~VirtualTexture();
+
+  // Page file of the image source in directory, named after its path
+  static std::string GetPageFilename(const std::string& source,
+                                     const std::string& directory);
+  // Whether filename is a complete page file baked from the current version
+  // of source, by its size and modification time
+  static bool IsPageFileCurrent(const std::string& filename,
+                                const std::string& source);
+  // Every level of texture baked from source page by page, rows of pages
+  // top-down, level after level. Pages past the edges repeat the last
+  // texels. Written to a temporary file renamed over filename, readers never
+  // see a partial page file
+  static void WritePageFile(const Texture* texture, const std::string& source,
+                            const std::string& filename);
+
+  int GetWidth() const;
+  int GetHeight() const;
+  int GetLevelsCount() const;
+  int GetLevelWidth(int level) const;
+  int GetLevelHeight(int level) const;
+
+  // RGBA8 of the texel at x and y of level, from the finest resident level
+  // covering it. Safe from any thread between updates
+  const uint8_t* Fetch(int level, int x, int y) const;
+  // Stream in up to max_pages of the pages fetched since the last update
+  // but missing, coarsest first, then start a new frame. Not concurrent with
+  // Fetch
+  void Update(int max_pages);
+
+  int GetResidentPagesCount() const;
+  // Bytes of the cache, the page table and the stamps
+  size_t GetMemorySize() const;
+
+ private:
+  struct PageLevel {
+    int width;
+    int height;
+    int pages_per_row;
+    // Index of the top-left page among the pages of all levels
+    int first_page;
+  };
+
+  void LoadPage(int page, int slot);
+
+  std::ifstream file_;
+  std::vector<PageLevel> levels_;
+  // Cache slot of every page, -1 when not resident
+  std::vector<int> page_table_;
+  // Frame of the last fetch of every page, resident or not
+  std::atomic<uint32_t>* page_frames_;
+  uint32_t frame_ = 1;
+
+  uint8_t* cache_;
+  int cache_pages_;
+  // Page in every slot, -1 when free. The first slots hold the pinned pages
+  std::vector<int> slot_pages_;
+  int pinned_pages_ = 0;
+};
+
+}  // namespace swr
+
+#endif  // SOFTWARE_RENDERER_INCLUDE_VIRTUAL_TEXTURE_H_
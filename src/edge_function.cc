@@ -0,0 +1,56 @@
+/**
+ * @file edge_function.cc
+ * @author Mao Zhang (mao.zhang233@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "edge_function.h"
+
+#include <cmath>
+
+namespace swr {
+
+bool SetupEdgeFunctions(const Vec3f* screen_coords, EdgeFunction* edges,
+                        int64_t& area) {
+  // Keep sub-pixel products well inside 64-bit range
+  const float max_coord = 32768.f;
+
+  int64_t x[3];
+  int64_t y[3];
+  for (int i = 0; i < 3; ++i) {
+    const Vec3f& v = screen_coords[i];
+    if (!(std::abs(v.x) < max_coord && std::abs(v.y) < max_coord)) {
+      return false;
+    }
+
+    x[i] = static_cast<int64_t>(std::round(v.x * SUBPIXEL_ONE));
+    y[i] = static_cast<int64_t>(std::round(v.y * SUBPIXEL_ONE));
+  }
+
+  for (int i = 0; i < 3; ++i) {
+    // Edge from vertex j to vertex k, opposite to vertex i
+    int j = (i + 1) % 3;
+    int k = (i + 2) % 3;
+
+    EdgeFunction& edge = edges[i];
+    edge.a = y[j] - y[k];
+    edge.b = x[k] - x[j];
+    edge.c = -(edge.a * x[j] + edge.b * y[j]);
+
+    // Top-left rule: pixels exactly on an edge belong to the triangle only
+    // if it is a left edge or a horizontal top edge
+    bool top_left = edge.a > 0 || (edge.a == 0 && edge.b < 0);
+    if (!top_left) {
+      edge.c -= 1;
+    }
+  }
+
+  area = edges[2].a * x[2] + edges[2].b * y[2] + edges[2].c;
+  return true;
+}
+
+}  // namespace swr
@@ -10,8 +10,10 @@
  */
 #include "model.h"
 
+#include <cmath>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -90,6 +92,8 @@ Model::Model(const std::string& filename) : vertices_(), faces_() {
     }
   }
 
+  ComputeTangents();
+
   std::clog << "----- Model: #Vertices: " << vertices_.size()
             << ", #Faces: " << faces_.size() << " -----" << std::endl;
 }
@@ -118,4 +122,80 @@ std::vector<int> Model::GetNormalIndices(int index) const {
   return normal_indices_[index];
 }
 Vec3f Model::GetNormalCoords(int index) const { return normal_coords_[index]; }
+
+std::vector<int> Model::GetTangentIndices(int index) const {
+  return tangent_indices_[index];
+}
+
+Vec4f Model::GetTangent(int index) const { return tangents_[index]; }
+
+void Model::ComputeTangents() {
+  std::map<std::pair<int, int>, int> corners;
+  std::vector<Vec3f> tangents;
+  std::vector<Vec3f> bitangents;
+  std::vector<int> normals;
+
+  tangent_indices_.resize(faces_.size());
+  for (size_t i = 0; i < faces_.size(); ++i) {
+    const std::vector<int>& face = faces_[i];
+    const std::vector<int>& texture_indices = texture_indices_[i];
+    const std::vector<int>& normal_indices = normal_indices_[i];
+
+    std::vector<int>& tangent_indices = tangent_indices_[i];
+    for (size_t j = 0; j < face.size(); ++j) {
+      auto key = std::make_pair(normal_indices[j], texture_indices[j]);
+      auto inserted =
+          corners.emplace(key, static_cast<int>(tangents.size()));
+      if (inserted.second) {
+        tangents.emplace_back();
+        bitangents.emplace_back();
+        normals.push_back(normal_indices[j]);
+      }
+      tangent_indices.push_back(inserted.first->second);
+    }
+
+    // Accumulate the uv gradients of every triangle of the face fan
+    for (size_t j = 1; j + 1 < face.size(); ++j) {
+      size_t k[3] = {0, j, j + 1};
+      Vec3f edge1 = vertices_[face[k[1]]] - vertices_[face[k[0]]];
+      Vec3f edge2 = vertices_[face[k[2]]] - vertices_[face[k[0]]];
+      Vec2f uv0 = texture_coords_[texture_indices[k[0]]];
+      Vec2f delta_uv1 = texture_coords_[texture_indices[k[1]]] - uv0;
+      Vec2f delta_uv2 = texture_coords_[texture_indices[k[2]]] - uv0;
+
+      float det = delta_uv1.x * delta_uv2.y - delta_uv2.x * delta_uv1.y;
+      if (det == 0.f) {
+        continue;
+      }
+      float f = 1.f / det;
+      Vec3f tangent = (edge1 * delta_uv2.y - edge2 * delta_uv1.y) * f;
+      Vec3f bitangent = (edge2 * delta_uv1.x - edge1 * delta_uv2.x) * f;
+
+      for (size_t corner : k) {
+        int index = tangent_indices[corner];
+        tangents[index] = tangents[index] + tangent;
+        bitangents[index] = bitangents[index] + bitangent;
+      }
+    }
+  }
+
+  // Gram-Schmidt against the normal, handedness from the bitangent
+  tangents_.resize(tangents.size());
+  for (size_t i = 0; i < tangents.size(); ++i) {
+    Vec3f normal = normal_coords_[normals[i]];
+    normal.Normalize();
+
+    Vec3f tangent = tangents[i] - normal * (normal * tangents[i]);
+    if (tangent * tangent == 0.f) {
+      // No uv gradient, any direction orthogonal to the normal will do
+      Vec3f axis = std::abs(normal.x) < .9f ? Vec3f(1.f, 0.f, 0.f)
+                                            : Vec3f(0.f, 1.f, 0.f);
+      tangent = axis - normal * (normal * axis);
+    }
+    tangent.Normalize();
+
+    float handedness = (normal ^ tangent) * bitangents[i] < 0.f ? -1.f : 1.f;
+    tangents_[i] = Vec4f(tangent, handedness);
+  }
+}
 }  // namespace swr
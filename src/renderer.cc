@@ -11,11 +11,15 @@
 #include "renderer.h"
 
 #include <algorithm>
+#include <cfloat>
 #include <chrono>
+#include <climits>
 #include <cmath>
+#include <cstring>
 #include <iostream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
 #define SOFTWARE_RENDERER_INCLUDE_VULKAN
@@ -33,7 +37,10 @@
 #include "image.h"
 #include "model.h"
 #include "shader.h"
+#include "simd.h"
+#include "thread_pool.h"
 #include "utils.h"
+#include "virtual_texture.h"
 
 #if _WIN32
 #pragma warning(disable : 4127)
@@ -64,6 +71,12 @@ const std::string SPECULAR_TEXTURE_FILENAME =
     "../obj/diablo3/diablo3_pose_spec.tga";
 #endif
 
+// Compressed format per ETexture. The object space normal map has signed z
+// and keeps all three channels, specular is gray
+const ETextureFormat COMPRESSED_TEXTURE_FORMATS[] = {
+    ETextureFormat::BC1_FORMAT, ETextureFormat::BC1_FORMAT,
+    ETextureFormat::BC5_FORMAT, ETextureFormat::BC4_FORMAT};
+
 Renderer::Renderer(VkPhysicalDevice& physical_device, VkDevice& device,
                    VkQueue& graphics_queue, VkCommandPool& command_pool)
     : physical_device_{physical_device},
@@ -72,12 +85,18 @@ Renderer::Renderer(VkPhysicalDevice& physical_device, VkDevice& device,
       command_pool_{command_pool} {
   std::clog << "----- Renderer::Renderer -----" << std::endl;
 
+  thread_count_ =
+      std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+
   LoadModel(MODEL_FILENAME);
   LoadTexture(ETexture::DIFFUSE_TEXTURE, DIFFUSE_TEXTURE_FILENAME);
   LoadTexture(ETexture::NORMAL_TEXTURE, NORMAL_TEXTURE_FILENAME);
   LoadTexture(ETexture::NORMAL_TANGENT_TEXTURE,
               NORMAL_TANGENT_TEXTURE_FILENAME);
   LoadTexture(ETexture::SPECULAR_TEXTURE, SPECULAR_TEXTURE_FILENAME);
+  if (enable_decoded_normals_) {
+    BuildNormalMaps();
+  }
 }
 
 Renderer::~Renderer() {
@@ -87,11 +106,14 @@ Renderer::~Renderer() {
   delete[] surface_;
   delete model_;
   delete zbuffer_;
-  delete[] diffuse_texture_;
-  delete[] normal_texture_;
-  delete[] normal_tangent_texture_;
-  delete[] specular_texture_;
-  delete shader_;
+  delete diffuse_texture_;
+  delete normal_texture_;
+  delete normal_tangent_texture_;
+  delete specular_texture_;
+  delete material_texture_;
+  delete normal_map_;
+  delete normal_tangent_map_;
+  delete thread_pool_;
 }
 
 void Renderer::OnUIRender() {
@@ -142,7 +164,7 @@ void Renderer::OnUIRender() {
   ImGui::EndChild();
 
   //  imgui child window: render
-  ImGui::BeginChild("Render", ImVec2(0.f, 220.f), true, window_flags);
+  ImGui::BeginChild("Render", ImVec2(0.f, 730.f), true, window_flags);
 
   if (ImGui::BeginMenuBar()) {
     ImGui::BeginMenu("Render", false);
@@ -174,6 +196,230 @@ void Renderer::OnUIRender() {
     pre_shading_mode = shading_mode_;
   }
 
+  // imgui: rasterizer radio
+  ImGui::Text("Rasterizer:");
+  ImGui::Indent();
+  ImGui::RadioButton("Barycentric", &rasterizer_,
+                     ERasterizer::BARYCENTRIC_RASTERIZER);
+  ImGui::RadioButton("Edge Function", &rasterizer_,
+                     ERasterizer::EDGE_FUNCTION_RASTERIZER);
+  ImGui::RadioButton("SIMD", &rasterizer_, ERasterizer::SIMD_RASTERIZER);
+  ImGui::Unindent();
+
+  if (pre_rasterizer_ != rasterizer_) {
+    need_reset_ = true;
+    pre_rasterizer_ = rasterizer_;
+  }
+
+  // imgui: render path radio
+  ImGui::Text("Render Path:");
+  ImGui::Indent();
+  ImGui::RadioButton("Forward", &render_path_,
+                     ERenderPath::FORWARD_RENDER_PATH);
+  ImGui::RadioButton("Visibility Buffer", &render_path_,
+                     ERenderPath::VISIBILITY_BUFFER_RENDER_PATH);
+  ImGui::Unindent();
+
+  if (pre_render_path_ != render_path_) {
+    need_reset_ = true;
+    pre_render_path_ = render_path_;
+  }
+
+  // imgui: precision radio
+  ImGui::Text("Precision:");
+  ImGui::Indent();
+  ImGui::RadioButton("Exact", &precision_, EPrecision::EXACT_PRECISION);
+  ImGui::RadioButton("Fast", &precision_, EPrecision::FAST_PRECISION);
+
+  if (ImGui::Button("Measure Error")) {
+    MeasurePrecisionError();
+  }
+
+  // imgui text: error of the fast tier per shading mode
+  if (!precision_paths_.empty()) {
+    ImGui::Text("Compared: %s", precision_paths_.c_str());
+  }
+  const char* shading_modes[] = {"Diffuse", "Phong", "Normal Mapping"};
+  for (size_t i = 0; i < precision_errors_.size(); ++i) {
+    const PrecisionError& error = precision_errors_[i];
+    ImGui::Text("%s: max %d %d %d, mean %.3f %.3f %.3f", shading_modes[i],
+                error.max[0], error.max[1], error.max[2], error.mean[0],
+                error.mean[1], error.mean[2]);
+  }
+  ImGui::Unindent();
+
+  if (pre_precision_ != precision_) {
+    need_reset_ = true;
+    pre_precision_ = precision_;
+  }
+
+  // imgui: texture filter radio
+  ImGui::Text("Texture Filter:");
+  ImGui::Indent();
+  ImGui::RadioButton("Nearest", &texture_filter_,
+                     ETextureFilter::NEAREST_FILTER);
+  ImGui::RadioButton("Bilinear", &texture_filter_,
+                     ETextureFilter::BILINEAR_FILTER);
+  ImGui::RadioButton("Trilinear", &texture_filter_,
+                     ETextureFilter::TRILINEAR_FILTER);
+  ImGui::Unindent();
+
+  if (pre_texture_filter_ != texture_filter_) {
+    need_reset_ = true;
+    pre_texture_filter_ = texture_filter_;
+  }
+
+  // imgui: tiled textures checkbox
+  ImGui::Checkbox("Tiled Textures", &enable_tiled_textures_);
+
+  if (pre_enable_tiled_textures_ != enable_tiled_textures_) {
+    // Convert in place, renders are not running
+    ETextureLayout layout = enable_tiled_textures_
+                                ? ETextureLayout::TILED_LAYOUT
+                                : ETextureLayout::LINEAR_LAYOUT;
+    for (Texture* texture : {diffuse_texture_, normal_texture_,
+                             normal_tangent_texture_, specular_texture_}) {
+      texture->SetLayout(layout);
+    }
+
+    need_reset_ = true;
+    pre_enable_tiled_textures_ = enable_tiled_textures_;
+  }
+
+  // imgui: compressed textures checkbox
+  ImGui::Checkbox("Compressed Textures", &enable_compressed_textures_);
+
+  if (pre_enable_compressed_textures_ != enable_compressed_textures_) {
+    // Encoding is lossy, reload from the files
+    ReloadTextures();
+
+    need_reset_ = true;
+    pre_enable_compressed_textures_ = enable_compressed_textures_;
+  }
+
+  // imgui: virtual textures checkbox
+  ImGui::Checkbox("Virtual Textures", &enable_virtual_textures_);
+
+  if (pre_enable_virtual_textures_ != enable_virtual_textures_) {
+    ReloadTextures();
+
+    need_reset_ = true;
+    pre_enable_virtual_textures_ = enable_virtual_textures_;
+  }
+
+  // imgui: material texture checkbox
+  ImGui::Checkbox("Material Texture", &enable_material_texture_);
+
+  if (pre_enable_material_texture_ != enable_material_texture_) {
+    if (enable_material_texture_) {
+      BuildMaterialTexture();
+    } else {
+      delete material_texture_;
+      material_texture_ = nullptr;
+    }
+
+    need_reset_ = true;
+    pre_enable_material_texture_ = enable_material_texture_;
+  }
+
+  // imgui: decoded normal maps checkbox
+  ImGui::Checkbox("Decoded Normal Maps", &enable_decoded_normals_);
+
+  if (pre_enable_decoded_normals_ != enable_decoded_normals_) {
+    if (enable_decoded_normals_) {
+      BuildNormalMaps();
+    } else {
+      delete normal_map_;
+      delete normal_tangent_map_;
+      normal_map_ = nullptr;
+      normal_tangent_map_ = nullptr;
+    }
+
+    need_reset_ = true;
+    pre_enable_decoded_normals_ = enable_decoded_normals_;
+  }
+
+  // imgui text: memory of all texture levels
+  size_t texture_memory = 0;
+  for (Texture* texture : {diffuse_texture_, normal_texture_,
+                           normal_tangent_texture_, specular_texture_}) {
+    texture_memory += texture->GetMemorySize();
+  }
+  if (material_texture_) {
+    texture_memory += material_texture_->GetMemorySize();
+  }
+  for (NormalMap* map : {normal_map_, normal_tangent_map_}) {
+    if (map) {
+      texture_memory += map->GetMemorySize();
+    }
+  }
+  ImGui::Text("Texture Memory: %.2f MB", texture_memory / 1048576.f);
+
+  // imgui text: pages in the caches of the virtual textures
+  if (enable_virtual_textures_) {
+    int resident_pages = 0;
+    for (Texture* texture : {diffuse_texture_, normal_texture_,
+                             normal_tangent_texture_, specular_texture_}) {
+      resident_pages += texture->GetVirtualTexture()->GetResidentPagesCount();
+    }
+    ImGui::Text("Resident Pages: %d", resident_pages);
+  }
+
+  // imgui: hierarchical zbuffer checkbox
+  ImGui::Checkbox("Hierarchical Z", &enable_hiz_);
+
+  // imgui: tile buffers checkbox
+  ImGui::Checkbox("Tile Buffers", &enable_tile_buffers_);
+
+  if (pre_enable_tile_buffers_ != enable_tile_buffers_) {
+    need_reset_ = true;
+    pre_enable_tile_buffers_ = enable_tile_buffers_;
+  }
+
+  // imgui: shadows checkbox
+  ImGui::Checkbox("Shadows", &enable_shadows_);
+
+  if (pre_enable_shadows_ != enable_shadows_) {
+    need_reset_ = true;
+    pre_enable_shadows_ = enable_shadows_;
+  }
+
+  // imgui: point lights slider
+  ImGui::Text("Point Lights:");
+  ImGui::Indent();
+  ImGui::SliderInt("##Point Lights", &point_lights_count_, 0, 256);
+  ImGui::Unindent();
+
+  if (pre_point_lights_count_ != point_lights_count_) {
+    // Spread over a sphere around the model with the golden angle
+    ClearLights();
+    for (int i = 0; i < point_lights_count_; ++i) {
+      float angle = 2.39996f * static_cast<float>(i);
+      float y = 1.f - 2.f * (static_cast<float>(i) + .5f) /
+                          static_cast<float>(point_lights_count_);
+      float ring = std::sqrt(1.f - y * y);
+
+      PointLight light;
+      light.position = Vec3f(ring * std::cos(angle), y, ring * std::sin(angle));
+      light.color = Vec3f(.5f + .5f * std::cos(angle),
+                          .5f + .5f * std::cos(angle + 2.09440f),
+                          .5f + .5f * std::cos(angle + 4.18879f));
+      light.radius = .6f;
+      AddLight(light);
+    }
+
+    need_reset_ = true;
+    pre_point_lights_count_ = point_lights_count_;
+  }
+
+  // imgui: worker threads slider
+  ImGui::Text("Threads:");
+  ImGui::Indent();
+  ImGui::SliderInt("##Threads", &thread_count_, 1,
+                   std::max(1, static_cast<int>(
+                                   std::thread::hardware_concurrency())));
+  ImGui::Unindent();
+
   // imgui: render button
   if (ImGui::Button(pause_ ? "Render" : "Pause")) {
     pause_ = !pause_;
@@ -203,11 +449,7 @@ void Renderer::Render() {
     surface_ = new Image(width_, height_, physical_device_, device_,
                          graphics_queue_, command_pool_);
 
-    need_reset_ = true;
-  }
-
-  if (need_reset_) {
-    need_reset_ = false;
+    // Render targets persist across frames and are only reallocated here
 
     // clear previous image data
     delete[] surface_data_;
@@ -219,8 +461,52 @@ void Renderer::Render() {
     delete zbuffer_;
     // allocate new zbuffer
     zbuffer_ = new std::vector<int>(height_ * width_, INT_MIN);
+
+    // reset hierarchical zbuffer
+    hiz_width_ = (static_cast<int>(width_) + RASTER_BLOCK_SIZE - 1) /
+                 RASTER_BLOCK_SIZE;
+    int hiz_height = (static_cast<int>(height_) + RASTER_BLOCK_SIZE - 1) /
+                     RASTER_BLOCK_SIZE;
+    hiz_.assign(hiz_width_ * hiz_height, INT_MIN);
+
+    // reset visibility buffer
+    visibility_.assign(height_ * width_, -1);
+
+    // split surface into tiles
+    tiles_.clear();
+    for (int y = 0; y < static_cast<int>(height_); y += TILE_SIZE) {
+      for (int x = 0; x < static_cast<int>(width_); x += TILE_SIZE) {
+        Tile tile{};
+        tile.x_min = x;
+        tile.y_min = y;
+        tile.x_max = std::min(x + TILE_SIZE, static_cast<int>(width_)) - 1;
+        tile.y_max = std::min(y + TILE_SIZE, static_cast<int>(height_)) - 1;
+        tile.hiz = INT_MIN;
+        tile.color_dirty = false;
+        tile.depth_clear_pending = false;
+        tiles_.push_back(tile);
+      }
+    }
+  }
+
+  if (need_reset_) {
+    need_reset_ = false;
+
+    // Start over from a fully cleared surface after a mode change
+    for (Tile& tile : tiles_) {
+      tile.color_dirty = true;
+    }
   }
 
+  if (!thread_pool_ || thread_pool_->GetThreadCount() != thread_count_) {
+    delete thread_pool_;
+    thread_pool_ = new ThreadPool(thread_count_);
+    tile_buffers_.resize(thread_count_);
+  }
+
+  // Fast clear, written lazily per tile
+  Clear();
+
   Vec3f light(0.f, 0.f, 1.f);
 
   Vec3f eye(0.f, 0.f, 3.f);
@@ -236,74 +522,168 @@ void Renderer::Render() {
   Mat4 viewport =
       Viewport(static_cast<float>(width_), static_cast<float>(height_));
 
-  // Shader
-  switch (shading_mode_) {
-    case 1:
-      shader_ = new PhongShader();
-      break;
-    case 2:
-      shader_ = new NormalMappingShader();
-      break;
-    default:
-      shader_ = new Shader();
-      break;
+  Mat4 mvp = viewport * projection * view;
+
+  // Uniform data for shader, read by every thread
+  uniforms_.mvp = mvp;
+  uniforms_.eye = eye;
+  uniforms_.light = light;
+  uniforms_.diffuse_texture = diffuse_texture_;
+  uniforms_.normal_texture = normal_texture_;
+  uniforms_.normal_tangent_texture = normal_tangent_texture_;
+  uniforms_.specular_texture = specular_texture_;
+  uniforms_.material_texture = material_texture_;
+  uniforms_.normal_map = normal_map_;
+  uniforms_.normal_tangent_map = normal_tangent_map_;
+  uniforms_.texture_filter = texture_filter_;
+  uniforms_.lights = lights_.data();
+
+  // Shadow map of the main light, cached across frames
+  uniforms_.shadow_map = nullptr;
+  if (enable_shadows_) {
+    UpdateShadowMap(light);
+    uniforms_.shadow_map = shadow_map_.data();
+  }
+  uniforms_.shadow_map_size = SHADOW_MAP_SIZE;
+  uniforms_.shadow_mvp = shadow_mvp_;
+
+  // Vertex stage specialized for the shading mode
+  static const VertexPipeline vertex_pipelines[][3] = {
+      {
+          &Renderer::ProcessVertices<Shader<ExactMath> >,
+          &Renderer::ProcessVertices<PhongShader<ExactMath> >,
+          &Renderer::ProcessVertices<NormalMappingShader<ExactMath> >,
+      },
+      {
+          &Renderer::ProcessVertices<Shader<FastMath> >,
+          &Renderer::ProcessVertices<PhongShader<FastMath> >,
+          &Renderer::ProcessVertices<NormalMappingShader<FastMath> >,
+      },
+  };
+  VertexPipeline vertex_pipeline =
+      vertex_pipelines[precision_][shading_mode_];
+
+  int faces_count = model_->GetFacesCount();
+  triangles_.resize(faces_count);
+
+  const int batch_size = 256;
+  int batches_count = (faces_count + batch_size - 1) / batch_size;
+  clipped_triangles_.resize(batches_count);
+  thread_pool_->ParallelFor(batches_count, [&](int batch, int /*thread*/) {
+    clipped_triangles_[batch].clear();
+    int end = std::min(faces_count, (batch + 1) * batch_size);
+    for (int i = batch * batch_size; i < end; ++i) {
+      (this->*vertex_pipeline)(i, triangles_[i], clipped_triangles_[batch]);
+    }
+  });
+
+  // Append triangles clipped into several pieces after the faces, links
+  // were local to their batch
+  for (int batch = 0; batch < batches_count; ++batch) {
+    int offset = static_cast<int>(triangles_.size());
+    int end = std::min(faces_count, (batch + 1) * batch_size);
+    for (int i = batch * batch_size; i < end; ++i) {
+      if (triangles_[i].next >= 0) {
+        triangles_[i].next += offset;
+      }
+    }
+    for (Triangle& triangle : clipped_triangles_[batch]) {
+      if (triangle.next >= 0) {
+        triangle.next += offset;
+      }
+      triangles_.push_back(triangle);
+    }
   }
 
-  // Uniform data for shader
-  shader_->SetVec3f(Vector::EYE, eye);
-  shader_->SetVec3f(Vector::LIGHT, light);
+  if (primitive_mode_ == 0) {
+    // Lines are not binned, clear the whole surface first
+    for (Tile& tile : tiles_) {
+      ClearTileColor(tile);
+      tile.color_dirty = true;
+    }
+
+    for (const Triangle& triangle : triangles_) {
+      if (triangle.rejected) {
+        continue;
+      }
 
-  Mat4 mvp = viewport * projection * view;
-  shader_->SetMat4(Matrix::MVP, mvp);
-
-  shader_->SetTexture(ETexture::DIFFUSE_TEXTURE, diffuse_texture_);
-  shader_->SetTexture(ETexture::NORMAL_TEXTURE, normal_texture_);
-  shader_->SetTexture(ETexture::NORMAL_TANGENT_TEXTURE,
-                      normal_tangent_texture_);
-  shader_->SetTexture(ETexture::SPECULAR_TEXTURE, specular_texture_);
-
-  // Put rendering logic here
-  for (int i = 0; i < model_->GetFacesCount(); ++i) {
-    std::vector<int> face = model_->GetFace(i);
-    std::vector<int> normal_indices = model_->GetNormalIndices(i);
-    std::vector<int> texture_indices = model_->GetTextureIndices(i);
-
-    // Transformation
-    std::vector<Vec3f> screen_coords(3);
-    std::vector<Vec3f> vertex_coords(3);
-    for (int j = 0; j < 3; ++j) {
-      Vec3f vertex = model_->GetVertex(face[j]);
-      vertex_coords.push_back(vertex);
-      shader_->SetVec3f(Vector::VERTEX, vertex);
-      Vec3f postion{};
-      shader_->Vertex(postion);
-      screen_coords[j] = postion;
-    }
-
-    if (primitive_mode_ == 0) {
       for (int j = 0; j < 3; ++j) {
-        int x0 = static_cast<int>(std::round(screen_coords[j].x));
-        int y0 = static_cast<int>(std::round(screen_coords[j].y));
-        int x1 = static_cast<int>(std::round(screen_coords[(j + 1) % 3].x));
-        int y1 = static_cast<int>(std::round(screen_coords[(j + 1) % 3].y));
+        const Vec3f& v0 = triangle.screen_coords[j];
+        const Vec3f& v1 = triangle.screen_coords[(j + 1) % 3];
+        int x0 = static_cast<int>(std::round(v0.x));
+        int y0 = static_cast<int>(std::round(v0.y));
+        int x1 = static_cast<int>(std::round(v1.x));
+        int y1 = static_cast<int>(std::round(v1.y));
         uint32_t pixel = GetColor(Vec3f(255.f, 255.f, 255.f));
         DrawLine(x0, y0, x1, y1, pixel);
       }
-    } else {
-      std::vector<Vec3f> normal_coords(3);
-      std::vector<Vec2f> texture_coords(3);
-      for (int j = 0; j < 3; ++j) {
-        normal_coords[j] = model_->GetNormalCoords(normal_indices[j]);
-        texture_coords[j] = model_->GetTextureCoords(texture_indices[j]);
-      }
-
-      DrawTriangle(screen_coords, vertex_coords, normal_coords, texture_coords);
     }
+  } else {
+    BinTriangles();
+    CullLights();
+
+    // Raster stage specialized for the shading mode, chosen once per frame
+    static const TilePipeline pipelines[][3] = {
+        {
+            &Renderer::DrawTile<Shader<ExactMath> >,
+            &Renderer::DrawTile<PhongShader<ExactMath> >,
+            &Renderer::DrawTile<NormalMappingShader<ExactMath> >,
+        },
+        {
+            &Renderer::DrawTile<Shader<FastMath> >,
+            &Renderer::DrawTile<PhongShader<FastMath> >,
+            &Renderer::DrawTile<NormalMappingShader<FastMath> >,
+        },
+    };
+    TilePipeline pipeline = pipelines[precision_][shading_mode_];
+
+    // Whole surface, rows stored bottom-up
+    RenderTarget surface_target{};
+    surface_target.color = surface_data_ + (height_ - 1) * width_;
+    surface_target.depth = zbuffer_->data();
+    surface_target.color_stride = -static_cast<int>(width_);
+    surface_target.depth_stride = static_cast<int>(width_);
+
+    // Rasterization stage: tiles own disjoint pixels, no locking required
+    thread_pool_->ParallelFor(
+        static_cast<int>(tiles_.size()), [&](int index, int thread) {
+          Tile& tile = tiles_[index];
+
+          // Empty tiles only need their clear color
+          if (tile.triangles.empty()) {
+            ClearTileColor(tile);
+            return;
+          }
+
+          RenderTarget target = surface_target;
+          if (enable_tile_buffers_) {
+            target = BeginTile(tile, tile_buffers_[thread]);
+          } else {
+            ClearTileColor(tile);
+            ClearTileDepth(tile);
+          }
+
+          (this->*pipeline)(tile, target);
+
+          if (enable_tile_buffers_) {
+            EndTile(tile, target);
+          }
+          tile.color_dirty = true;
+        });
   }
 
   // set image data
   surface_->SetData(surface_data_);
 
+  // Stream in the pages the frame fetched but missed, later frames sample
+  // them
+  for (Texture* texture : {diffuse_texture_, normal_texture_,
+                           normal_tangent_texture_, specular_texture_}) {
+    if (texture->GetVirtualTexture()) {
+      texture->GetVirtualTexture()->Update(VIRTUAL_PAGES_PER_FRAME);
+    }
+  }
+
   // end time
   auto end = std::chrono::high_resolution_clock::now();
 
@@ -324,29 +704,64 @@ void Renderer::LoadModel(const std::string& filename) {
   }
 }
 
+void Renderer::AddLight(const PointLight& light) { lights_.push_back(light); }
+
+void Renderer::ClearLights() { lights_.clear(); }
+
 void Renderer::LoadTexture(int type, const std::string& filename) {
   std::clog << "----- Renderer::LoadTexture -----" << std::endl;
 
-  int width, height, channels;
-  uint8_t* data = stbi_load(filename.c_str(), &width, &height, &channels, 4);
+  // Pages of a virtual texture are baked once into the page directory, later
+  // loads only open the page file until the image changes. Baking decodes
+  // the whole image once, like a regular load
+  std::string pages_filename =
+      VirtualTexture::GetPageFilename(filename, VIRTUAL_PAGE_DIRECTORY);
+  bool baked = enable_virtual_textures_ &&
+               VirtualTexture::IsPageFileCurrent(pages_filename, filename);
+
+  Texture* texture = nullptr;
+  if (!baked) {
+    int width, height, channels;
+    uint8_t* data =
+        stbi_load(filename.c_str(), &width, &height, &channels, 4);
+
+    if (!data) {
+      throw std::runtime_error("----- Error::LOAD_TEXTURE_FAILURE -----");
+    }
 
-  if (!data) {
-    throw std::runtime_error("----- Error::LOAD_TEXTURE_FAILURE -----");
+    texture = new Texture(width, height, data);
+    texture->GenerateMipmaps();
+    if (enable_virtual_textures_) {
+      VirtualTexture::WritePageFile(texture, filename, pages_filename);
+      delete texture;
+    }
   }
 
-  Texture* texture = new Texture(width, height, data);
+  if (enable_virtual_textures_) {
+    texture = new Texture(
+        new VirtualTexture(pages_filename, VIRTUAL_CACHE_PAGES));
+  }
+  texture->SetLayout(enable_tiled_textures_ ? ETextureLayout::TILED_LAYOUT
+                                            : ETextureLayout::LINEAR_LAYOUT);
+  if (enable_compressed_textures_) {
+    texture->Compress(COMPRESSED_TEXTURE_FORMATS[type]);
+  }
 
   switch (type) {
     case ETexture::DIFFUSE_TEXTURE:
+      delete diffuse_texture_;
       diffuse_texture_ = texture;
       break;
     case ETexture::NORMAL_TEXTURE:
+      delete normal_texture_;
       normal_texture_ = texture;
       break;
     case ETexture::NORMAL_TANGENT_TEXTURE:
+      delete normal_tangent_texture_;
       normal_tangent_texture_ = texture;
       break;
     case ETexture::SPECULAR_TEXTURE:
+      delete specular_texture_;
       specular_texture_ = texture;
       break;
     default:
@@ -354,64 +769,836 @@ void Renderer::LoadTexture(int type, const std::string& filename) {
   }
 }
 
-void Renderer::DrawTriangle(std::vector<Vec3f>& screen_coords,
-                            std::vector<Vec3f>& vertex_coords,
-                            std::vector<Vec3f>& normal_coords,
-                            std::vector<Vec2f>& texture_coords) {
+void Renderer::BuildMaterialTexture() {
+  std::clog << "----- Renderer::BuildMaterialTexture -----" << std::endl;
+
+  delete material_texture_;
+  material_texture_ = nullptr;
+  if (enable_virtual_textures_) {
+    return;
+  }
+
+  material_texture_ = new MaterialTexture(diffuse_texture_,
+                                          normal_tangent_texture_,
+                                          specular_texture_);
+}
+
+void Renderer::BuildNormalMaps() {
+  std::clog << "----- Renderer::BuildNormalMaps -----" << std::endl;
+
+  delete normal_map_;
+  delete normal_tangent_map_;
+  normal_map_ = nullptr;
+  normal_tangent_map_ = nullptr;
+  // Maps would undo the savings of compressed and virtual textures
+  if (enable_virtual_textures_ || enable_compressed_textures_) {
+    return;
+  }
+
+  normal_map_ = new NormalMap(normal_texture_);
+  normal_tangent_map_ = new NormalMap(normal_tangent_texture_);
+}
+
+void Renderer::ReloadTextures() {
+  std::clog << "----- Renderer::ReloadTextures -----" << std::endl;
+
+  LoadTexture(ETexture::DIFFUSE_TEXTURE, DIFFUSE_TEXTURE_FILENAME);
+  LoadTexture(ETexture::NORMAL_TEXTURE, NORMAL_TEXTURE_FILENAME);
+  LoadTexture(ETexture::NORMAL_TANGENT_TEXTURE,
+              NORMAL_TANGENT_TEXTURE_FILENAME);
+  LoadTexture(ETexture::SPECULAR_TEXTURE, SPECULAR_TEXTURE_FILENAME);
+  if (enable_material_texture_) {
+    BuildMaterialTexture();
+  }
+  if (enable_decoded_normals_) {
+    BuildNormalMaps();
+  }
+}
+
+void Renderer::MeasurePrecisionError() {
+  std::clog << "----- Renderer::MeasurePrecisionError -----" << std::endl;
+
+  if (!width_ || !height_) {
+    return;
+  }
+
+  int precision = precision_;
+  int shading_mode = shading_mode_;
+
+  // Both tiers run through the selected paths only, batched shaders unless
+  // every fragment is shaded on its own
+  const char* rasterizers[] = {"Barycentric", "Edge Function", "SIMD"};
+  const char* render_paths[] = {"Forward", "Visibility Buffer"};
+  const char* texture_filters[] = {"Nearest", "Bilinear", "Trilinear"};
+  bool batched = rasterizer_ == ERasterizer::SIMD_RASTERIZER ||
+                 render_path_ == ERenderPath::VISIBILITY_BUFFER_RENDER_PATH;
+  precision_paths_ = std::string(rasterizers[rasterizer_]) + ", " +
+                     render_paths[render_path_] + ", " +
+                     (batched ? "Batched" : "Per Fragment") + ", " +
+                     texture_filters[texture_filter_];
+  std::clog << "----- Precision Error: " << precision_paths_ << " -----"
+            << std::endl;
+
+  size_t pixels_count = static_cast<size_t>(width_) * height_;
+  std::vector<uint32_t> exact(pixels_count);
+
+  precision_errors_.assign(3, PrecisionError{});
+  for (int mode = 0; mode < 3; ++mode) {
+    shading_mode_ = mode;
+
+    precision_ = EPrecision::EXACT_PRECISION;
+    need_reset_ = true;
+    Render();
+    std::copy(surface_data_, surface_data_ + pixels_count, exact.begin());
+
+    precision_ = EPrecision::FAST_PRECISION;
+    need_reset_ = true;
+    Render();
+
+    PrecisionError& error = precision_errors_[mode];
+    double sum[3] = {};
+    size_t covered = 0;
+    for (size_t i = 0; i < pixels_count; ++i) {
+      uint32_t a = exact[i];
+      uint32_t b = surface_data_[i];
+      if (!a && !b) {
+        continue;
+      }
+
+      ++covered;
+      for (int c = 0; c < 3; ++c) {
+        int channel_a = static_cast<int>(a >> (8 * c) & 0xff);
+        int channel_b = static_cast<int>(b >> (8 * c) & 0xff);
+        int difference = std::abs(channel_a - channel_b);
+        error.max[c] = std::max(error.max[c], difference);
+        sum[c] += difference;
+      }
+    }
+
+    for (int c = 0; c < 3; ++c) {
+      error.mean[c] =
+          covered ? static_cast<float>(sum[c] / static_cast<double>(covered))
+                  : 0.f;
+    }
+
+    std::clog << "----- Precision Error: Shading Mode " << mode << ", Max "
+              << error.max[0] << " " << error.max[1] << " " << error.max[2]
+              << ", Mean " << error.mean[0] << " " << error.mean[1] << " "
+              << error.mean[2] << " -----" << std::endl;
+  }
+
+  // Back to the selected modes on the next frame
+  precision_ = precision;
+  shading_mode_ = shading_mode;
+  need_reset_ = true;
+}
+
+template <typename ShaderT>
+void Renderer::ProcessVertices(int face, Triangle& triangle,
+                               std::vector<Triangle>& clipped) {
+  std::vector<int> vertex_indices = model_->GetFace(face);
+  std::vector<int> normal_indices = model_->GetNormalIndices(face);
+  std::vector<int> texture_indices = model_->GetTextureIndices(face);
+  std::vector<int> tangent_indices = model_->GetTangentIndices(face);
+
+  // Transformation
+  ClipVertex vertices[3];
+  for (int j = 0; j < 3; ++j) {
+    Attributes attributes;
+    attributes.vertex = model_->GetVertex(vertex_indices[j]);
+    attributes.normal = model_->GetNormalCoords(normal_indices[j]);
+    attributes.tangent = model_->GetTangent(tangent_indices[j]);
+    attributes.texture = model_->GetTextureCoords(texture_indices[j]);
+
+    Vec4f position{};
+    ShaderT::Vertex(uniforms_, attributes, position, vertices[j].varyings);
+
+    // PerspectiveProject maps points in front of the camera to negative w,
+    // flip the homogeneous coordinates so those have positive w instead
+    vertices[j].position = position * -1.f;
+  }
+
+  triangle.rejected = true;
+  triangle.culled = true;
+  triangle.next = -1;
+
+  // Outcodes against the view frustum and the clipping planes
+  int outside_all = (1 << ClipPlane::CLIP_PLANES_COUNT) - 1;
+  int outside_any = 0;
+  for (int j = 0; j < 3; ++j) {
+    int outcode = 0;
+    for (int plane = 0; plane < ClipPlane::CLIP_PLANES_COUNT; ++plane) {
+      if (ClipDistance(vertices[j].position, plane) < 0.f) {
+        outcode |= 1 << plane;
+      }
+    }
+    outside_all &= outcode;
+    outside_any |= outcode;
+  }
+
+  // Trivial reject: all vertices outside the same frustum plane
+  const int frustum_planes = (1 << ClipPlane::LEFT_PLANE) |
+                             (1 << ClipPlane::RIGHT_PLANE) |
+                             (1 << ClipPlane::BOTTOM_PLANE) |
+                             (1 << ClipPlane::TOP_PLANE) |
+                             (1 << ClipPlane::NEAR_PLANE) |
+                             (1 << ClipPlane::FAR_PLANE);
+  if (outside_all & frustum_planes) {
+    return;
+  }
+
+  // Only triangles crossing the near plane or the guard band get clipped
+  const int clip_planes = (1 << ClipPlane::NEAR_PLANE) |
+                          (1 << ClipPlane::LEFT_GUARD_PLANE) |
+                          (1 << ClipPlane::RIGHT_GUARD_PLANE) |
+                          (1 << ClipPlane::BOTTOM_GUARD_PLANE) |
+                          (1 << ClipPlane::TOP_GUARD_PLANE);
+  if (!(outside_any & clip_planes)) {
+    SetupTriangle(vertices, triangle);
+    return;
+  }
+
+  // Sutherland-Hodgman in homogeneous coordinates, each plane adds at most
+  // one vertex
+  const int max_vertices = 3 + ClipPlane::CLIP_PLANES_COUNT;
+  ClipVertex polygons[2][max_vertices];
+  ClipVertex* polygon = polygons[0];
+  ClipVertex* output = polygons[1];
+  int count = 3;
+  std::copy(vertices, vertices + 3, polygon);
+
+  for (int plane = 0; plane < ClipPlane::CLIP_PLANES_COUNT && count >= 3;
+       ++plane) {
+    if (!((outside_any & clip_planes) >> plane & 1)) {
+      continue;
+    }
+
+    int output_count = 0;
+    for (int j = 0; j < count; ++j) {
+      const ClipVertex& a = polygon[j];
+      const ClipVertex& b = polygon[(j + 1) % count];
+      float distance_a = ClipDistance(a.position, plane);
+      float distance_b = ClipDistance(b.position, plane);
+
+      if (distance_a >= 0.f) {
+        output[output_count++] = a;
+      }
+
+      if ((distance_a >= 0.f) != (distance_b >= 0.f)) {
+        // Varyings are affine in clip space
+        float t = distance_a / (distance_a - distance_b);
+        ClipVertex& v = output[output_count++];
+        v.position = a.position + (b.position - a.position) * t;
+
+        float values[3][VARYINGS_COUNT];
+        std::memcpy(values[0], &a.varyings, sizeof(Varyings));
+        std::memcpy(values[1], &b.varyings, sizeof(Varyings));
+        for (int i = 0; i < VARYINGS_COUNT; ++i) {
+          values[2][i] = values[0][i] + (values[1][i] - values[0][i]) * t;
+        }
+        std::memcpy(&v.varyings, values[2], sizeof(Varyings));
+      }
+    }
+
+    std::swap(polygon, output);
+    count = output_count;
+  }
+
+  // Fan triangulation, the first piece replaces the face and the others are
+  // linked after it
+  Triangle* piece = &triangle;
+  for (int j = 1; j + 1 < count; ++j) {
+    if (piece != &triangle) {
+      piece->next = -1;
+    }
+
+    ClipVertex fan[3] = {polygon[0], polygon[j], polygon[j + 1]};
+    SetupTriangle(fan, *piece);
+
+    if (j + 2 < count) {
+      piece->next = static_cast<int>(clipped.size());
+      clipped.emplace_back();
+      piece = &clipped.back();
+    }
+  }
+}
+
+void Renderer::SetupTriangle(const ClipVertex* vertices, Triangle& triangle) {
+  for (int j = 0; j < 3; ++j) {
+    const Vec4f& position = vertices[j].position;
+
+    // Perspective division
+    triangle.inverse_w[j] = 1.f / position.w;
+    triangle.screen_coords[j] = Vec3f(position.x * triangle.inverse_w[j],
+                                      position.y * triangle.inverse_w[j],
+                                      position.z * triangle.inverse_w[j]);
+  }
+
+  triangle.rejected = false;
+
+  const Vec3f* screen_coords = triangle.screen_coords;
+
   // Bounding Box
-  int x_min = static_cast<int>(std::round(std::min(
+  triangle.x_min = static_cast<int>(std::round(std::min(
       std::min(screen_coords[0].x, screen_coords[1].x), screen_coords[2].x)));
-  int y_min = static_cast<int>(std::round(std::min(
+  triangle.y_min = static_cast<int>(std::round(std::min(
       std::min(screen_coords[0].y, screen_coords[1].y), screen_coords[2].y)));
-  int x_max = static_cast<int>(std::round(std::max(
+  triangle.x_max = static_cast<int>(std::round(std::max(
       std::max(screen_coords[0].x, screen_coords[1].x), screen_coords[2].x)));
-  int y_max = static_cast<int>(std::round(std::max(
+  triangle.y_max = static_cast<int>(std::round(std::max(
       std::max(screen_coords[0].y, screen_coords[1].y), screen_coords[2].y)));
 
-  // TBN Matrix
   Vec3f edge1 = screen_coords[1] - screen_coords[0];
   Vec3f edge2 = screen_coords[2] - screen_coords[0];
 
-  // Backface culling
+  // Backface culling, degenerate triangles cover no pixel
   Vec3f clockwise = edge1 ^ edge2;
-  if (clockwise.z < 0.f) {
+  triangle.culled = clockwise.z <= 0.f;
+  if (triangle.culled) {
     return;
   }
 
-  Vec2f delta_uv1 = texture_coords[1] - texture_coords[0];
-  Vec2f delta_uv2 = texture_coords[2] - texture_coords[0];
-  float f = 1.0f / (delta_uv1.x * delta_uv2.y - delta_uv2.x * delta_uv1.y);
-  Vec3f tagent{
-      f * (delta_uv2.y * edge1.x - delta_uv1.y * edge2.x),
-      f * (delta_uv2.y * edge1.y - delta_uv1.y * edge2.y),
-      f * (delta_uv2.y * edge1.z - delta_uv1.y * edge2.z),
-  };
-  Vec3f bitangent{
-      f * (-delta_uv2.x * edge1.x + delta_uv1.x * edge2.x),
-      f * (-delta_uv2.x * edge1.y + delta_uv1.x * edge2.y),
-      f * (-delta_uv2.x * edge1.z + delta_uv1.x * edge2.z),
-  };
-  shader_->SetVec3f(Vector::TANGENT, tagent);
-  shader_->SetVec3f(Vector::BITANGENT, bitangent);
+  SetupEdgeFunctions(triangle);
+  SetupPlanes(vertices, triangle);
+}
+
+void Renderer::BinTriangles() {
+  int tiles_per_row = (static_cast<int>(width_) + TILE_SIZE - 1) / TILE_SIZE;
 
-  std::vector<int> horizontal_iterator{};
-  for (int x = x_min; x <= x_max; ++x) {
-    horizontal_iterator.push_back(x);
+  for (Tile& tile : tiles_) {
+    tile.triangles.clear();
+    tile.z_min = FLT_MAX;
+    tile.z_max = -FLT_MAX;
   }
 
-  std::vector<int> vertical_iterator{};
+  // Faces in submission order, each followed by its clipped pieces
+  int faces_count = model_->GetFacesCount();
+  for (int face = 0; face < faces_count; ++face) {
+    for (int i = face; i >= 0; i = triangles_[i].next) {
+      const Triangle& triangle = triangles_[i];
+      if (triangle.rejected || triangle.culled) {
+        continue;
+      }
+
+      // Skip triangles beyond surface
+      if (triangle.x_max < 0 || triangle.y_max < 0 ||
+          triangle.x_min >= static_cast<int>(width_) ||
+          triangle.y_min >= static_cast<int>(height_)) {
+        continue;
+      }
+
+      // Bounding box clamped to surface
+      int column_min = std::max(triangle.x_min, 0) / TILE_SIZE;
+      int row_min = std::max(triangle.y_min, 0) / TILE_SIZE;
+      int column_max =
+          std::min(triangle.x_max, static_cast<int>(width_) - 1) / TILE_SIZE;
+      int row_max =
+          std::min(triangle.y_max, static_cast<int>(height_) - 1) / TILE_SIZE;
+
+      const Vec3f* v = triangle.screen_coords;
+      float z_min = std::min(std::min(v[0].z, v[1].z), v[2].z);
+      float z_max = std::max(std::max(v[0].z, v[1].z), v[2].z);
+
+      for (int row = row_min; row <= row_max; ++row) {
+        for (int column = column_min; column <= column_max; ++column) {
+          Tile& tile = tiles_[row * tiles_per_row + column];
+          tile.triangles.push_back(i);
+          tile.z_min = std::min(tile.z_min, z_min);
+          tile.z_max = std::max(tile.z_max, z_max);
+        }
+      }
+    }
+  }
+}
+
+void Renderer::CullLights() {
+  light_bounds_.resize(lights_.size());
+  for (size_t i = 0; i < lights_.size(); ++i) {
+    light_bounds_[i] = GetLightBounds(lights_[i]);
+  }
+
+  // Tiles own their lists, no locking required
+  thread_pool_->ParallelFor(
+      static_cast<int>(tiles_.size()), [&](int index, int /*thread*/) {
+        Tile& tile = tiles_[index];
+        tile.lights.clear();
+        if (tile.triangles.empty()) {
+          return;
+        }
+
+        for (size_t i = 0; i < light_bounds_.size(); ++i) {
+          const LightBounds& bounds = light_bounds_[i];
+          if (bounds.x_max < tile.x_min || bounds.x_min > tile.x_max ||
+              bounds.y_max < tile.y_min || bounds.y_min > tile.y_max ||
+              bounds.z_max < tile.z_min || bounds.z_min > tile.z_max) {
+            continue;
+          }
+          tile.lights.push_back(static_cast<int>(i));
+        }
+      });
+}
+
+LightBounds Renderer::GetLightBounds(const PointLight& light) const {
+  LightBounds bounds{0,
+                     0,
+                     static_cast<int>(width_) - 1,
+                     static_cast<int>(height_) - 1,
+                     -FLT_MAX,
+                     FLT_MAX};
+
+  // The projected corners of the box around the sphere enclose it, as long
+  // as all of them are in front of the eye
+  float x_min = FLT_MAX;
+  float y_min = FLT_MAX;
+  float x_max = -FLT_MAX;
+  float y_max = -FLT_MAX;
+  float z_min = FLT_MAX;
+  float z_max = -FLT_MAX;
+  for (int i = 0; i < 8; ++i) {
+    Vec3f corner{
+        light.position.x + (i & 1 ? light.radius : -light.radius),
+        light.position.y + (i & 2 ? light.radius : -light.radius),
+        light.position.z + (i & 4 ? light.radius : -light.radius)};
+    Vec4f position = uniforms_.mvp * Vec4f{corner, 1.f} * -1.f;
+    if (position.w <= 0.f) {
+      return bounds;
+    }
+
+    float inverse_w = 1.f / position.w;
+    x_min = std::min(x_min, position.x * inverse_w);
+    y_min = std::min(y_min, position.y * inverse_w);
+    x_max = std::max(x_max, position.x * inverse_w);
+    y_max = std::max(y_max, position.y * inverse_w);
+    z_min = std::min(z_min, position.z * inverse_w);
+    z_max = std::max(z_max, position.z * inverse_w);
+  }
+
+  // Clamp before converting, bounds far off surface stay outside of it
+  float width = static_cast<float>(width_);
+  float height = static_cast<float>(height_);
+  bounds.x_min = static_cast<int>(std::floor(std::clamp(x_min, -1.f, width)));
+  bounds.y_min = static_cast<int>(std::floor(std::clamp(y_min, -1.f, height)));
+  bounds.x_max = static_cast<int>(std::ceil(std::clamp(x_max, -1.f, width)));
+  bounds.y_max = static_cast<int>(std::ceil(std::clamp(y_max, -1.f, height)));
+  bounds.z_min = z_min;
+  bounds.z_max = z_max;
+  return bounds;
+}
+
+void Renderer::UpdateShadowMap(const Vec3f& light) {
+  if (shadow_model_ == model_ && shadow_light_.x == light.x &&
+      shadow_light_.y == light.y && shadow_light_.z == light.z) {
+    return;
+  }
+  shadow_model_ = model_;
+  shadow_light_ = light;
+
+  // The main light sits close to the model, a wide frustum towards its
+  // center covers nearly the whole half space in front of it
+  Vec3f eye = light;
+  Vec3f center(0.f, 0.f, 0.f);
+  Mat4 view = LookAt(eye, center);
+  Mat4 projection = PerspectiveProject(-.05f, -5.f, 160.f, 1.f);
+
+  // Depth in [0, 1] rather than z indices, precise enough in float
+  float size = static_cast<float>(SHADOW_MAP_SIZE);
+  Mat4 viewport = Viewport(size, size);
+  viewport[2][2] = .5f;
+  viewport[2][3] = .5f;
+
+  shadow_mvp_ = viewport * projection * view;
+
+  int faces_count = model_->GetFacesCount();
+  shadow_triangles_.resize(faces_count);
+
+  const int batch_size = 256;
+  int batches_count = (faces_count + batch_size - 1) / batch_size;
+  thread_pool_->ParallelFor(batches_count, [&](int batch, int /*thread*/) {
+    int end = std::min(faces_count, (batch + 1) * batch_size);
+    for (int i = batch * batch_size; i < end; ++i) {
+      SetupDepthTriangle(i, shadow_triangles_[i]);
+    }
+  });
+
+  shadow_map_.assign(SHADOW_MAP_SIZE * SHADOW_MAP_SIZE, -FLT_MAX);
+
+  // Bands of rows own disjoint texels, no locking required
+  const int band_height = 32;
+  int bands_count = (SHADOW_MAP_SIZE + band_height - 1) / band_height;
+  thread_pool_->ParallelFor(bands_count, [&](int band, int /*thread*/) {
+    int band_y_min = band * band_height;
+    int band_y_max = std::min(band_y_min + band_height, SHADOW_MAP_SIZE) - 1;
+    for (const DepthTriangle& triangle : shadow_triangles_) {
+      if (triangle.culled || triangle.y_max < band_y_min ||
+          triangle.y_min > band_y_max) {
+        continue;
+      }
+      RasterizeDepth(triangle, std::max(triangle.y_min, band_y_min),
+                     std::min(triangle.y_max, band_y_max));
+    }
+  });
+}
+
+void Renderer::SetupDepthTriangle(int face, DepthTriangle& triangle) const {
+  std::vector<int> vertex_indices = model_->GetFace(face);
+
+  triangle.culled = true;
+
+  Vec3f* v = triangle.screen_coords;
+  for (int j = 0; j < 3; ++j) {
+    Vec4f position =
+        shadow_mvp_ * Vec4f{model_->GetVertex(vertex_indices[j]), 1.f} * -1.f;
+
+    // Faces reaching behind the light are not clipped, they shadow nothing
+    // in front of it
+    if (position.w <= 0.f) {
+      return;
+    }
+
+    float inverse_w = 1.f / position.w;
+    v[j] = Vec3f(position.x * inverse_w, position.y * inverse_w,
+                 position.z * inverse_w);
+  }
+
+  // Front faces cast shadows, like in the main pass
+  float x1 = v[1].x - v[0].x;
+  float y1 = v[1].y - v[0].y;
+  float x2 = v[2].x - v[0].x;
+  float y2 = v[2].y - v[0].y;
+  float det = x1 * y2 - x2 * y1;
+  if (det <= 0.f) {
+    return;
+  }
+
+  float max_coord = static_cast<float>(SHADOW_MAP_SIZE - 1);
+  float x_min = std::max(std::min(std::min(v[0].x, v[1].x), v[2].x), 0.f);
+  float y_min = std::max(std::min(std::min(v[0].y, v[1].y), v[2].y), 0.f);
+  float x_max =
+      std::min(std::max(std::max(v[0].x, v[1].x), v[2].x), max_coord);
+  float y_max =
+      std::min(std::max(std::max(v[0].y, v[1].y), v[2].y), max_coord);
+  if (x_min > x_max || y_min > y_max) {
+    return;
+  }
+  triangle.x_min = static_cast<int>(std::ceil(x_min));
+  triangle.y_min = static_cast<int>(std::ceil(y_min));
+  triangle.x_max = static_cast<int>(std::floor(x_max));
+  triangle.y_max = static_cast<int>(std::floor(y_max));
+
+  int64_t area = 0;
+  if (!swr::SetupEdgeFunctions(v, triangle.edges, area) || area <= 0) {
+    return;
+  }
+
+  // Depth is affine in shadow map space
+  float dz1 = v[1].z - v[0].z;
+  float dz2 = v[2].z - v[0].z;
+  Plane& depth = triangle.depth;
+  depth.origin = v[0].z;
+  depth.dx = (dz1 * y2 - dz2 * y1) / det;
+  depth.dy = (dz2 * x1 - dz1 * x2) / det;
+
+  // Steep casters need more offset to clear their own receivers
+  depth.origin -= SHADOW_BIAS +
+                  SHADOW_SLOPE_BIAS *
+                      std::max(std::abs(depth.dx), std::abs(depth.dy));
+
+  triangle.culled = false;
+}
+
+void Renderer::RasterizeDepth(const DepthTriangle& triangle, int y_min,
+                              int y_max) {
+  int x_min = triangle.x_min;
+  int x_max = triangle.x_max;
+
+  // Edge functions and depth at the first texel, then stepped incrementally
+  const EdgeFunction* edges = triangle.edges;
+  int64_t row[3];
+  int64_t step_x[3];
+  int64_t step_y[3];
+  for (int i = 0; i < 3; ++i) {
+    row[i] = edges[i].a * (static_cast<int64_t>(x_min) << SUBPIXEL_BITS) +
+             edges[i].b * (static_cast<int64_t>(y_min) << SUBPIXEL_BITS) +
+             edges[i].c;
+    step_x[i] = edges[i].a << SUBPIXEL_BITS;
+    step_y[i] = edges[i].b << SUBPIXEL_BITS;
+  }
+
+  const Plane& depth = triangle.depth;
+  const Vec3f& origin = triangle.screen_coords[0];
+  float row_z = depth.At(static_cast<float>(x_min) - origin.x,
+                         static_cast<float>(y_min) - origin.y);
+
   for (int y = y_min; y <= y_max; ++y) {
-    vertical_iterator.push_back(y);
+    int64_t w0 = row[0];
+    int64_t w1 = row[1];
+    int64_t w2 = row[2];
+    float z = row_z;
+    float* texels = shadow_map_.data() + y * SHADOW_MAP_SIZE;
+
+    for (int x = x_min; x <= x_max; ++x) {
+      if ((w0 | w1 | w2) >= 0) {
+        texels[x] = std::max(texels[x], z);
+      }
+
+      w0 += step_x[0];
+      w1 += step_x[1];
+      w2 += step_x[2];
+      z += depth.dx;
+    }
+
+    row[0] += step_y[0];
+    row[1] += step_y[1];
+    row[2] += step_y[2];
+    row_z += depth.dy;
+  }
+}
+
+void Renderer::Clear() {
+  // Color is cleared on demand as long as it is dirty
+  for (Tile& tile : tiles_) {
+    tile.depth_clear_pending = true;
+  }
+}
+
+void Renderer::ClearTileColor(Tile& tile) {
+  if (!tile.color_dirty) {
+    return;
+  }
+
+  int width = tile.x_max - tile.x_min + 1;
+  for (int y = tile.y_min; y <= tile.y_max; ++y) {
+    int row = static_cast<int>(height_) - 1 - y;
+    std::fill_n(surface_data_ + row * width_ + tile.x_min, width, 0);
+  }
+  tile.color_dirty = false;
+}
+
+void Renderer::ClearTileDepth(Tile& tile) {
+  if (!tile.depth_clear_pending) {
+    return;
+  }
+
+  int width = tile.x_max - tile.x_min + 1;
+  for (int y = tile.y_min; y <= tile.y_max; ++y) {
+    std::fill_n(zbuffer_->data() + y * width_ + tile.x_min, width, INT_MIN);
+  }
+  ResetHiZ(tile);
+  tile.depth_clear_pending = false;
+}
+
+void Renderer::ResetHiZ(Tile& tile) {
+  for (int y = tile.y_min; y <= tile.y_max; y += RASTER_BLOCK_SIZE) {
+    for (int x = tile.x_min; x <= tile.x_max; x += RASTER_BLOCK_SIZE) {
+      hiz_[x / RASTER_BLOCK_SIZE + y / RASTER_BLOCK_SIZE * hiz_width_] =
+          INT_MIN;
+    }
+  }
+  tile.hiz = INT_MIN;
+}
+
+RenderTarget Renderer::BeginTile(Tile& tile, TileBuffer& buffer) {
+  RenderTarget target{};
+  target.color = buffer.color;
+  target.depth = buffer.depth;
+  target.x_origin = tile.x_min;
+  target.y_origin = tile.y_min;
+  target.color_stride = TILE_SIZE;
+  target.depth_stride = TILE_SIZE;
+
+  // Tile-local depth starts empty every frame, and so does its bound
+  int width = tile.x_max - tile.x_min + 1;
+  for (int y = tile.y_min; y <= tile.y_max; ++y) {
+    std::fill_n(&target.Color(tile.x_min, y), width, 0);
+    std::fill_n(&target.Depth(tile.x_min, y), width, INT_MIN);
+  }
+
+  ResetHiZ(tile);
+
+  return target;
+}
+
+void Renderer::EndTile(const Tile& tile, const RenderTarget& target) {
+  // One contiguous row at a time, depth stays in the tile
+  int width = tile.x_max - tile.x_min + 1;
+  for (int y = tile.y_min; y <= tile.y_max; ++y) {
+    int row = static_cast<int>(height_) - 1 - y;
+    std::copy_n(&target.Color(tile.x_min, y), width,
+                surface_data_ + row * width_ + tile.x_min);
+  }
+}
+
+template <typename ShaderT>
+void Renderer::DrawTile(Tile& tile, const RenderTarget& target) {
+  LightList lights{tile.lights.data(), static_cast<int>(tile.lights.size())};
+  for (int i : tile.triangles) {
+    DrawTriangle<ShaderT>(triangles_[i], tile, lights, target);
+  }
+
+  // Shading pass once the visible triangle of every pixel is known
+  if (render_path_ == ERenderPath::VISIBILITY_BUFFER_RENDER_PATH) {
+    ResolveVisibility<ShaderT>(tile, target);
+  }
+}
+
+template <typename ShaderT>
+void Renderer::DrawTriangle(const Triangle& triangle, Tile& tile,
+                            const LightList& lights,
+                            const RenderTarget& target) {
+  // Bounding box clipped to tile, which already lies inside surface
+  int x_min = std::max(triangle.x_min, tile.x_min);
+  int y_min = std::max(triangle.y_min, tile.y_min);
+  int x_max = std::min(triangle.x_max, tile.x_max);
+  int y_max = std::min(triangle.y_max, tile.y_max);
+
+  if (rasterizer_ == ERasterizer::BARYCENTRIC_RASTERIZER ||
+      !triangle.fixed_point) {
+    RasterizeBarycentric<ShaderT>(triangle, x_min, y_min, x_max, y_max,
+                                  lights, target);
+    return;
   }
 
-  for (int x = x_min; x <= x_max; ++x) {
-    for (int y = y_min; y <= y_max; ++y) {
-      // Avoid coordinate beyond surface
-      if (x < 0 || y < 0 || x >= static_cast<int>(width_) ||
-          y >= static_cast<int>(height_)) {
+  // Lanes of a block are evaluated in 32 bits
+  bool simd_range = true;
+  for (const EdgeFunction& edge : triangle.edges) {
+    simd_range = simd_range && IsSimdEdge(edge);
+  }
+
+  bool simd = rasterizer_ == ERasterizer::SIMD_RASTERIZER && simd_range;
+
+  // Whole triangle behind everything written in tile
+  if (enable_hiz_ &&
+      NearestDepth(triangle, x_min, y_min, x_max, y_max) <=
+          static_cast<float>(tile.hiz)) {
+    return;
+  }
+  bool hiz_dirty = false;
+
+  // Hierarchical traversal: blocks aligned inside tile in row-major order,
+  // rejected or accepted as a whole by the edge functions at their corners
+  const EdgeFunction* edges = triangle.edges;
+  int block_x_min = x_min - (x_min - tile.x_min) % RASTER_BLOCK_SIZE;
+  int block_y_min = y_min - (y_min - tile.y_min) % RASTER_BLOCK_SIZE;
+
+  for (int block_y = block_y_min; block_y <= y_max;
+       block_y += RASTER_BLOCK_SIZE) {
+    for (int block_x = block_x_min; block_x <= x_max;
+         block_x += RASTER_BLOCK_SIZE) {
+      int x0 = std::max(block_x, x_min);
+      int y0 = std::max(block_y, y_min);
+      int x1 = std::min(block_x + RASTER_BLOCK_SIZE - 1, x_max);
+      int y1 = std::min(block_y + RASTER_BLOCK_SIZE - 1, y_max);
+
+      // Whole quads are visited by SIMD, classify all of them
+      if (simd) {
+        x0 -= (x0 - tile.x_min) % simd::BLOCK_WIDTH;
+        y0 -= (y0 - tile.y_min) % simd::BLOCK_HEIGHT;
+        x1 = std::min(x1 + simd::BLOCK_WIDTH - 1 -
+                          (x1 - tile.x_min) % simd::BLOCK_WIDTH,
+                      tile.x_max);
+        y1 = std::min(y1 + simd::BLOCK_HEIGHT - 1 -
+                          (y1 - tile.y_min) % simd::BLOCK_HEIGHT,
+                      tile.y_max);
+      }
+
+      bool outside = false;
+      bool covered = true;
+      for (int i = 0; i < 3; ++i) {
+        int64_t w = edges[i].a * (static_cast<int64_t>(x0) << SUBPIXEL_BITS) +
+                    edges[i].b * (static_cast<int64_t>(y0) << SUBPIXEL_BITS) +
+                    edges[i].c;
+        int64_t dx = edges[i].a * (static_cast<int64_t>(x1 - x0)
+                                   << SUBPIXEL_BITS);
+        int64_t dy = edges[i].b * (static_cast<int64_t>(y1 - y0)
+                                   << SUBPIXEL_BITS);
+
+        // Extremes of a linear function over a rectangle are at corners
+        int64_t w_max = w + std::max<int64_t>(dx, 0) + std::max<int64_t>(dy, 0);
+        int64_t w_min = w + std::min<int64_t>(dx, 0) + std::min<int64_t>(dy, 0);
+        outside = outside || w_max < 0;
+        covered = covered && w_min >= 0;
+      }
+
+      if (outside) {
         continue;
       }
 
+      // Block behind everything written in it
+      int* hiz = &hiz_[block_x / RASTER_BLOCK_SIZE +
+                       block_y / RASTER_BLOCK_SIZE * hiz_width_];
+      if (enable_hiz_ &&
+          NearestDepth(triangle, x0, y0, x1, y1) <= static_cast<float>(*hiz)) {
+        continue;
+      }
+
+      bool written =
+          simd ? RasterizeSimd<ShaderT>(triangle, tile, x0, y0, x1, y1,
+                                        covered, lights, target)
+               : RasterizeEdgeFunction<ShaderT>(triangle, x0, y0, x1, y1,
+                                                covered, lights, target);
+
+      // Only pixels in front of the block's farthest one can raise it
+      if (written && enable_hiz_) {
+        UpdateHiZ(block_x, block_y, tile, target);
+        hiz_dirty = true;
+      }
+    }
+  }
+
+  if (hiz_dirty) {
+    int tile_hiz = INT_MAX;
+    for (int block_y = tile.y_min; block_y <= tile.y_max;
+         block_y += RASTER_BLOCK_SIZE) {
+      for (int block_x = tile.x_min; block_x <= tile.x_max;
+           block_x += RASTER_BLOCK_SIZE) {
+        tile_hiz = std::min(tile_hiz,
+                            hiz_[block_x / RASTER_BLOCK_SIZE +
+                                 block_y / RASTER_BLOCK_SIZE * hiz_width_]);
+      }
+    }
+    tile.hiz = tile_hiz;
+  }
+}
+
+float Renderer::NearestDepth(const Triangle& triangle, int x_min, int y_min,
+                             int x_max, int y_max) {
+  // Extremes of a plane over a rectangle are at corners
+  const Plane& depth = triangle.depth;
+  float dx = static_cast<float>(x_max - x_min) * depth.dx;
+  float dy = static_cast<float>(y_max - y_min) * depth.dy;
+  float z = depth.At(static_cast<float>(x_min) - triangle.screen_coords[0].x,
+                     static_cast<float>(y_min) - triangle.screen_coords[0].y) +
+            std::max(dx, 0.f) + std::max(dy, 0.f);
+
+  // Margin for rounding to z index and for incremental interpolation
+  return z + std::abs(z) * HIZ_TOLERANCE + 1.f;
+}
+
+void Renderer::UpdateHiZ(int block_x, int block_y, const Tile& tile,
+                         const RenderTarget& target) {
+  int x_max = std::min(block_x + RASTER_BLOCK_SIZE - 1, tile.x_max);
+  int y_max = std::min(block_y + RASTER_BLOCK_SIZE - 1, tile.y_max);
+
+  int farthest = INT_MAX;
+  for (int y = block_y; y <= y_max; ++y) {
+    for (int x = block_x; x <= x_max; ++x) {
+      farthest = std::min(farthest, target.Depth(x, y));
+    }
+  }
+
+  hiz_[block_x / RASTER_BLOCK_SIZE + block_y / RASTER_BLOCK_SIZE * hiz_width_] =
+      farthest;
+}
+
+template <typename ShaderT>
+void Renderer::RasterizeBarycentric(const Triangle& triangle, int x_min,
+                                    int y_min, int x_max, int y_max,
+                                    const LightList& lights,
+                                    const RenderTarget& target) {
+  const Vec3f* screen_coords = triangle.screen_coords;
+
+  for (int y = y_min; y <= y_max; ++y) {
+    for (int x = x_min; x <= x_max; ++x) {
       Vec3f bc =
           Barycentric(static_cast<float>(x), static_cast<float>(y),
                       screen_coords[0], screen_coords[1], screen_coords[2]);
@@ -424,56 +1611,429 @@ void Renderer::DrawTriangle(std::vector<Vec3f>& screen_coords,
                                           screen_coords[1].z * bc.y +
                                           screen_coords[2].z * bc.z));
 
-      // Depth test
-      if ((*(zbuffer_))[x + y * width_] >= z) {
+      DrawFragment<ShaderT>(triangle, x, y, z, lights, target);
+    }
+  }
+}
+
+template <typename ShaderT>
+bool Renderer::RasterizeEdgeFunction(const Triangle& triangle, int x_min,
+                                     int y_min, int x_max, int y_max,
+                                     bool covered, const LightList& lights,
+                                     const RenderTarget& target) {
+  // Edge functions and depth at the first pixel, then stepped incrementally
+  const EdgeFunction* edges = triangle.edges;
+  int64_t row[3];
+  int64_t step_x[3];
+  int64_t step_y[3];
+  for (int i = 0; i < 3; ++i) {
+    row[i] = edges[i].a * (static_cast<int64_t>(x_min) << SUBPIXEL_BITS) +
+             edges[i].b * (static_cast<int64_t>(y_min) << SUBPIXEL_BITS) +
+             edges[i].c;
+    step_x[i] = edges[i].a << SUBPIXEL_BITS;
+    step_y[i] = edges[i].b << SUBPIXEL_BITS;
+  }
+
+  const Plane& depth = triangle.depth;
+  float row_z = depth.At(static_cast<float>(x_min) - triangle.screen_coords[0].x,
+                         static_cast<float>(y_min) - triangle.screen_coords[0].y);
+
+  bool written = false;
+  for (int y = y_min; y <= y_max; ++y) {
+    int64_t w0 = row[0];
+    int64_t w1 = row[1];
+    int64_t w2 = row[2];
+    float z = row_z;
+
+    for (int x = x_min; x <= x_max; ++x) {
+      if (covered || (w0 | w1 | w2) >= 0) {
+        written = DrawFragment<ShaderT>(triangle, x, y,
+                                        static_cast<int>(std::round(z)),
+                                        lights, target) ||
+                  written;
+      }
+
+      w0 += step_x[0];
+      w1 += step_x[1];
+      w2 += step_x[2];
+      z += depth.dx;
+    }
+
+    row[0] += step_y[0];
+    row[1] += step_y[1];
+    row[2] += step_y[2];
+    row_z += depth.dy;
+  }
+
+  return written;
+}
+
+template <typename ShaderT>
+bool Renderer::RasterizeSimd(const Triangle& triangle, const Tile& tile,
+                             int x_min, int y_min, int x_max, int y_max,
+                             bool covered, const LightList& lights,
+                             const RenderTarget& target) {
+  const int lanes = simd::LANES;
+  const int block_width = simd::BLOCK_WIDTH;
+  const int block_height = simd::BLOCK_HEIGHT;
+
+  const EdgeFunction* edges = triangle.edges;
+  const Plane& depth_plane = triangle.depth;
+  const Vec3f& origin = triangle.screen_coords[0];
+
+  // Edge function and depth offsets of each lane from the block origin
+  simd::Int offsets[3];
+  for (int i = 0; i < 3; ++i) {
+    offsets[i] = EdgeLaneOffsets(edges[i]);
+  }
+
+  float lane_depths[lanes];
+  for (int lane = 0; lane < lanes; ++lane) {
+    lane_depths[lane] =
+        static_cast<float>(lane % block_width) * depth_plane.dx +
+        static_cast<float>(lane / block_width) * depth_plane.dy;
+  }
+  simd::Float depth_offsets = simd::Load(lane_depths);
+
+  // Lanes outside the bounding box are outside the triangle as well
+  bool written = false;
+  for (int y = y_min; y <= y_max; y += block_height) {
+    for (int x = x_min; x <= x_max; x += block_width) {
+      simd::Int coverage = simd::Set(0);
+      if (!covered) {
+        for (int i = 0; i < 3; ++i) {
+          coverage = coverage | EvaluateEdgeBlock(edges[i], offsets[i], x, y);
+        }
+      }
+
+      simd::Int mask = coverage > simd::Set(-1);
+      if (!simd::MoveMask(mask)) {
+        continue;
+      }
+
+      // Interpolated z index
+      float block_z = depth_plane.At(static_cast<float>(x) - origin.x,
+                                     static_cast<float>(y) - origin.y);
+      simd::Int z = simd::ToInt(simd::Set(block_z) + depth_offsets);
+
+      // Depth test, lanes beyond tile never pass
+      bool inside_tile = x + block_width - 1 <= tile.x_max &&
+                         y + block_height - 1 <= tile.y_max;
+      int* row0 = &target.Depth(x, y);
+      int* row1 = row0 + target.depth_stride;
+
+      int depths[lanes];
+      simd::Int depth{};
+      if (inside_tile) {
+        depth = simd::LoadBlock(row0, row1);
+      } else {
+        for (int lane = 0; lane < lanes; ++lane) {
+          int lane_x = x + lane % block_width;
+          int lane_y = y + lane / block_width;
+          depths[lane] = lane_x <= tile.x_max && lane_y <= tile.y_max
+                             ? target.Depth(lane_x, lane_y)
+                             : INT_MAX;
+        }
+        depth = simd::Load(depths);
+      }
+
+      mask = mask & (z > depth);
+      int bits = simd::MoveMask(mask);
+      if (!bits) {
         continue;
       }
 
       // Update z index
-      (*(zbuffer_))[x + y * width_] = z;
-
-      // Interpolated fragment coordinates
-      Vec3f fragment_position{
-          (vertex_coords[0].x * bc.x + vertex_coords[1].x * bc.y +
-           vertex_coords[2].x * bc.z),
-          (vertex_coords[0].y * bc.x + vertex_coords[1].y * bc.y +
-           vertex_coords[2].y * bc.z),
-          (vertex_coords[0].z * bc.x + vertex_coords[1].z * bc.y +
-           vertex_coords[2].z * bc.z),
-      };
-      shader_->SetVec3f(Vector::FRAGMENT, fragment_position);
-
-      // Interpolated normal vectors
-      Vec3f normal{
-          (normal_coords[0].x * bc.x + normal_coords[1].x * bc.y +
-           normal_coords[2].x * bc.z),
-          (normal_coords[0].y * bc.x + normal_coords[1].y * bc.y +
-           normal_coords[2].y * bc.z),
-          (normal_coords[0].z * bc.x + normal_coords[1].z * bc.y +
-           normal_coords[2].z * bc.z),
-      };
-      shader_->SetVec3f(Vector::NORMAL, normal);
-
-      // Interpolated texture coordinates
-      int u = static_cast<int>(
-          std::round((texture_coords[0].u * bc.x + texture_coords[1].u * bc.y +
-                      texture_coords[2].u * bc.z) *
-                     diffuse_texture_->GetWidth()));
-      int v = static_cast<int>(
-          std::round((texture_coords[0].v * bc.x + texture_coords[1].v * bc.y +
-                      texture_coords[2].v * bc.z) *
-                     diffuse_texture_->GetHeight()));
-      Vec2i uv{u, v};
-      shader_->SetVec2i(uv);
-
-      uint32_t pixel = 0;
-      shader_->Fragment(pixel);
-
-      SetPixel(x, y, pixel);
+      depth = simd::Select(mask, z, depth);
+      if (inside_tile) {
+        simd::StoreBlock(row0, row1, depth);
+      } else {
+        simd::Store(depths, depth);
+        for (int lane = 0; lane < lanes; ++lane) {
+          if (bits >> lane & 1) {
+            int lane_x = x + lane % block_width;
+            int lane_y = y + lane / block_width;
+            target.Depth(lane_x, lane_y) = depths[lane];
+          }
+        }
+      }
+
+      // Shade surviving lanes
+      if (render_path_ == ERenderPath::FORWARD_RENDER_PATH) {
+        ShadeBlock<ShaderT>(triangle, x, y, bits, lights, target);
+      } else {
+        for (int lane = 0; lane < lanes; ++lane) {
+          if (bits >> lane & 1) {
+            WriteFragment<ShaderT>(triangle, x + lane % block_width,
+                                   y + lane / block_width, lights, target);
+          }
+        }
+      }
+      written = true;
+    }
+  }
+
+  return written;
+}
+
+template <typename ShaderT>
+bool Renderer::DrawFragment(const Triangle& triangle, int x, int y, int z,
+                            const LightList& lights,
+                            const RenderTarget& target) {
+  // Depth test
+  int& depth = target.Depth(x, y);
+  if (depth >= z) {
+    return false;
+  }
+
+  // Update z index
+  depth = z;
+
+  WriteFragment<ShaderT>(triangle, x, y, lights, target);
+  return true;
+}
+
+template <typename ShaderT>
+void Renderer::WriteFragment(const Triangle& triangle, int x, int y,
+                             const LightList& lights,
+                             const RenderTarget& target) {
+  if (render_path_ == ERenderPath::VISIBILITY_BUFFER_RENDER_PATH) {
+    visibility_[x + y * width_] =
+        static_cast<int>(&triangle - triangles_.data());
+    return;
+  }
+
+  ShadeFragment<ShaderT>(triangle, x, y, lights, target);
+}
+
+template <typename ShaderT>
+void Renderer::ResolveVisibility(const Tile& tile,
+                                 const RenderTarget& target) {
+  const int lanes = simd::LANES;
+
+  LightList lights{tile.lights.data(), static_cast<int>(tile.lights.size())};
+  bool filtered = uniforms_.texture_filter != ETextureFilter::NEAREST_FILTER;
+
+  // Runs of simd::LANES pixels along each row, every lane may belong to a
+  // different triangle so interpolation stays per lane, and so do the quad
+  // derivatives
+  for (int y = tile.y_min; y <= tile.y_max; ++y) {
+    for (int x = tile.x_min; x <= tile.x_max; x += lanes) {
+      float values[VARYINGS_COUNT][lanes] = {};
+      float derivative_values[4][lanes] = {};
+      int mask = 0;
+      for (int lane = 0; lane < lanes && x + lane <= tile.x_max; ++lane) {
+        int& id = visibility_[x + lane + y * width_];
+        if (id < 0) {
+          continue;
+        }
+
+        const Triangle& triangle = triangles_[id];
+        Varyings varyings;
+        InterpolateVaryings(triangle, x + lane, y, varyings);
+        float lane_values[VARYINGS_COUNT];
+        std::memcpy(lane_values, &varyings, sizeof(varyings));
+        for (int i = 0; i < VARYINGS_COUNT; ++i) {
+          values[i][lane] = lane_values[i];
+        }
+        if (filtered) {
+          UvDerivatives derivatives;
+          InterpolateUvDerivatives(triangle, x + lane, y, derivatives);
+          derivative_values[0][lane] = derivatives.dx.u;
+          derivative_values[1][lane] = derivatives.dx.v;
+          derivative_values[2][lane] = derivatives.dy.u;
+          derivative_values[3][lane] = derivatives.dy.v;
+        }
+        mask |= 1 << lane;
+
+        // Leave the buffer empty for the next frame
+        id = -1;
+      }
+      if (!mask) {
+        continue;
+      }
+
+      simd::Float batch_values[VARYINGS_COUNT];
+      for (int i = 0; i < VARYINGS_COUNT; ++i) {
+        batch_values[i] = simd::Load(values[i]);
+      }
+      VaryingsBatch varyings;
+      std::memcpy(&varyings, batch_values, sizeof(varyings));
+      UvDerivativesBatch derivatives{
+          {simd::Load(derivative_values[0]), simd::Load(derivative_values[1])},
+          {simd::Load(derivative_values[2]), simd::Load(derivative_values[3])}};
+
+      simd::Int pixels;
+      ShaderT::FragmentBatch(uniforms_, varyings, derivatives, lights, mask,
+                             pixels);
+
+      int colors[lanes];
+      simd::Store(colors, pixels);
+      for (int lane = 0; lane < lanes; ++lane) {
+        if (mask >> lane & 1) {
+          target.Color(x + lane, y) = static_cast<uint32_t>(colors[lane]);
+        }
+      }
+    }
+  }
+}
+
+template <typename ShaderT>
+void Renderer::ShadeFragment(const Triangle& triangle, int x, int y,
+                             const LightList& lights,
+                             const RenderTarget& target) {
+  Varyings varyings;
+  InterpolateVaryings(triangle, x, y, varyings);
+
+  // Only filtered sampling reads them
+  UvDerivatives derivatives{};
+  if (uniforms_.texture_filter != ETextureFilter::NEAREST_FILTER) {
+    InterpolateUvDerivatives(triangle, x, y, derivatives);
+  }
+
+  // Statically bound, no virtual dispatch
+  uint32_t pixel = 0;
+  ShaderT::Fragment(uniforms_, varyings, derivatives, lights, pixel);
+
+  target.Color(x, y) = pixel;
+}
+
+template <typename ShaderT>
+void Renderer::ShadeBlock(const Triangle& triangle, int x, int y, int mask,
+                          const LightList& lights,
+                          const RenderTarget& target) {
+  const int lanes = simd::LANES;
+  const int block_width = simd::BLOCK_WIDTH;
+
+  float lane_x[lanes];
+  float lane_y[lanes];
+  for (int lane = 0; lane < lanes; ++lane) {
+    lane_x[lane] = static_cast<float>(lane % block_width);
+    lane_y[lane] = static_cast<float>(lane / block_width);
+  }
+  simd::Float offset_x = simd::Load(lane_x);
+  simd::Float offset_y = simd::Load(lane_y);
+
+  float dx = static_cast<float>(x) - triangle.screen_coords[0].x;
+  float dy = static_cast<float>(y) - triangle.screen_coords[0].y;
+  auto interpolate = [&](const Plane& plane) {
+    return simd::Set(plane.At(dx, dy)) + simd::Set(plane.dx) * offset_x +
+           simd::Set(plane.dy) * offset_y;
+  };
+
+  // Perspective correction
+  simd::Float w = simd::Set(1.f) / interpolate(triangle.inverse_w_plane);
+  simd::Float values[VARYINGS_COUNT];
+  for (int i = 0; i < VARYINGS_COUNT; ++i) {
+    values[i] = interpolate(triangle.varyings[i]) * w;
+  }
+  VaryingsBatch varyings;
+  std::memcpy(&varyings, values, sizeof(varyings));
+
+  // Blocks hold whole quads, differences between their lanes give the
+  // derivatives like on GPUs, inactive lanes act as helpers
+  UvDerivativesBatch derivatives{};
+  if (uniforms_.texture_filter != ETextureFilter::NEAREST_FILTER) {
+    float uv[2][lanes];
+    simd::Store(uv[0], varyings.uv.x);
+    simd::Store(uv[1], varyings.uv.y);
+
+    float derivative_values[4][lanes];
+    for (int lane = 0; lane < lanes; ++lane) {
+      // Top left pixel of the quad
+      int quad = lane % block_width & ~1;
+      for (int i = 0; i < 2; ++i) {
+        derivative_values[i][lane] = uv[i][quad + 1] - uv[i][quad];
+        derivative_values[2 + i][lane] =
+            uv[i][quad + block_width] - uv[i][quad];
+      }
+    }
+    derivatives.dx = {simd::Load(derivative_values[0]),
+                      simd::Load(derivative_values[1])};
+    derivatives.dy = {simd::Load(derivative_values[2]),
+                      simd::Load(derivative_values[3])};
+  }
+
+  simd::Int pixels;
+  ShaderT::FragmentBatch(uniforms_, varyings, derivatives, lights, mask,
+                         pixels);
+
+  int colors[lanes];
+  simd::Store(colors, pixels);
+  for (int lane = 0; lane < lanes; ++lane) {
+    if (mask >> lane & 1) {
+      target.Color(x + lane % block_width, y + lane / block_width) =
+          static_cast<uint32_t>(colors[lane]);
     }
   }
 }
 
+void Renderer::InterpolateVaryings(const Triangle& triangle, int x, int y,
+                                   Varyings& varyings) {
+  float dx = static_cast<float>(x) - triangle.screen_coords[0].x;
+  float dy = static_cast<float>(y) - triangle.screen_coords[0].y;
+
+  // Perspective correction
+  float w = 1.f / triangle.inverse_w_plane.At(dx, dy);
+  float values[VARYINGS_COUNT];
+  for (int i = 0; i < VARYINGS_COUNT; ++i) {
+    values[i] = triangle.varyings[i].At(dx, dy) * w;
+  }
+  std::memcpy(&varyings, values, sizeof(varyings));
+}
+
+void Renderer::InterpolateUvDerivatives(const Triangle& triangle, int x,
+                                        int y, UvDerivatives& derivatives) {
+  // Differences across the quad holding the pixel, from its top left one
+  auto uv_at = [&](int px, int py) {
+    float dx = static_cast<float>(px) - triangle.screen_coords[0].x;
+    float dy = static_cast<float>(py) - triangle.screen_coords[0].y;
+    float w = 1.f / triangle.inverse_w_plane.At(dx, dy);
+    return Vec2f{triangle.varyings[UV_VARYING].At(dx, dy) * w,
+                 triangle.varyings[UV_VARYING + 1].At(dx, dy) * w};
+  };
+
+  int quad_x = x & ~1;
+  int quad_y = y & ~1;
+  Vec2f uv = uv_at(quad_x, quad_y);
+  derivatives.dx = uv_at(quad_x + 1, quad_y) - uv;
+  derivatives.dy = uv_at(quad_x, quad_y + 1) - uv;
+}
+
+float Renderer::ClipDistance(const Vec4f& position, int plane) const {
+  // Largest depth that still converts to an integer z index
+  const float max_depth = static_cast<float>(INT_MAX - 1024);
+
+  float width = static_cast<float>(width_);
+  float height = static_cast<float>(height_);
+
+  // Viewport is part of the clip transformation, x / w lies in [0, width]
+  switch (plane) {
+    case ClipPlane::LEFT_PLANE:
+      return position.x;
+    case ClipPlane::RIGHT_PLANE:
+      return width * position.w - position.x;
+    case ClipPlane::BOTTOM_PLANE:
+      return position.y;
+    case ClipPlane::TOP_PLANE:
+      return height * position.w - position.y;
+    case ClipPlane::NEAR_PLANE:
+      return max_depth * position.w - position.z;
+    case ClipPlane::FAR_PLANE:
+      return position.z;
+    case ClipPlane::LEFT_GUARD_PLANE:
+      return position.x + GUARD_BAND * position.w;
+    case ClipPlane::RIGHT_GUARD_PLANE:
+      return (width + GUARD_BAND) * position.w - position.x;
+    case ClipPlane::BOTTOM_GUARD_PLANE:
+      return position.y + GUARD_BAND * position.w;
+    case ClipPlane::TOP_GUARD_PLANE:
+      return (height + GUARD_BAND) * position.w - position.y;
+    default:
+      return 0.f;
+  }
+}
+
 void Renderer::DrawLine(int x0, int y0, int x1, int y1, uint32_t pixel) {
   bool steep = false;
 
@@ -496,11 +2056,17 @@ void Renderer::DrawLine(int x0, int y0, int x1, int y1, uint32_t pixel) {
   int err_2 = 0;
   int y_step = y1 > y0 ? 1 : -1;
 
+  int width = static_cast<int>(steep ? height_ : width_);
+  int height = static_cast<int>(steep ? width_ : height_);
+
   for (int x = x0; x <= x1; ++x) {
-    if (steep) {
-      SetPixel(y, x, pixel);
-    } else {
-      SetPixel(x, y, pixel);
+    // Lines may leave surface within the guard band
+    if (x >= 0 && x < width && y >= 0 && y < height) {
+      if (steep) {
+        SetPixel(y, x, pixel);
+      } else {
+        SetPixel(x, y, pixel);
+      }
     }
 
     err_2 += d_err_2;
@@ -534,13 +2100,66 @@ bool Renderer::InsideTriangle(int x, int y, Vec2i& v0, Vec2i& v1, Vec2i& v2) {
   return ((z0.z > 0) == (z1.z > 0)) && ((z0.z > 0) == (z2.z > 0));
 }
 
-Vec3f Renderer::Barycentric(float x, float y, Vec3f& v0, Vec3f& v1, Vec3f& v2) {
+Vec3f Renderer::Barycentric(float x, float y, const Vec3f& v0, const Vec3f& v1,
+                            const Vec3f& v2) {
   Vec3f u = Vec3f(v2.x - v0.x, v1.x - v0.x, v0.x - x) ^
             Vec3f(v2.y - v0.y, v1.y - v0.y, v0.y - y);
 
   return Vec3f(1.f - (u.x + u.y) / u.z, u.y / u.z, u.x / u.z);
 }
 
+void Renderer::SetupEdgeFunctions(Triangle& triangle) {
+  int64_t area = 0;
+  if (!swr::SetupEdgeFunctions(triangle.screen_coords, triangle.edges,
+                               area)) {
+    triangle.fixed_point = false;
+    return;
+  }
+
+  // Degenerate after snapping, covers no pixel center
+  if (area <= 0) {
+    triangle.culled = true;
+    return;
+  }
+
+  triangle.fixed_point = true;
+}
+
+void Renderer::SetupPlanes(const ClipVertex* vertices, Triangle& triangle) {
+  const Vec3f* v = triangle.screen_coords;
+  float x1 = v[1].x - v[0].x;
+  float y1 = v[1].y - v[0].y;
+  float x2 = v[2].x - v[0].x;
+  float y2 = v[2].y - v[0].y;
+  float inverse_det = 1.f / (x1 * y2 - x2 * y1);
+
+  // Gradients of a function given its values at the three vertices
+  auto setup = [&](float a0, float a1, float a2) {
+    float da1 = a1 - a0;
+    float da2 = a2 - a0;
+    return Plane{a0, (da1 * y2 - da2 * y1) * inverse_det,
+                 (da2 * x1 - da1 * x2) * inverse_det};
+  };
+
+  // Depth is affine in screen space
+  triangle.depth = setup(v[0].z, v[1].z, v[2].z);
+
+  // Varyings divided by w are affine in screen space
+  const float* inverse_w = triangle.inverse_w;
+  triangle.inverse_w_plane = setup(inverse_w[0], inverse_w[1], inverse_w[2]);
+
+  float varyings[3][VARYINGS_COUNT];
+  for (int j = 0; j < 3; ++j) {
+    std::memcpy(varyings[j], &vertices[j].varyings, sizeof(Varyings));
+  }
+
+  for (int i = 0; i < VARYINGS_COUNT; ++i) {
+    triangle.varyings[i] = setup(varyings[0][i] * inverse_w[0],
+                                 varyings[1][i] * inverse_w[1],
+                                 varyings[2][i] * inverse_w[2]);
+  }
+}
+
 uint32_t Renderer::GetColor(const Vec3f& color) {
   uint32_t R = static_cast<uint32_t>(color.x);
   uint32_t G = static_cast<uint32_t>(color.y);
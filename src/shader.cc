@@ -11,9 +11,9 @@
 #include "shader.h"
 
 #include <algorithm>
+#include <cfloat>
 #include <cmath>
 #include <cstdint>
-#include <vector>
 
 #include "texture.h"
 #include "utils.h"
@@ -24,184 +24,1164 @@
 
 namespace swr {
 
-void Shader::SetVec2i(Vec2i& vec) { uv_ = vec; }
-
-void Shader::SetVec3f(int name, Vec3f& vec) {
-  switch (name) {
-    case Vector::VERTEX:
-      vertex_ = vec;
-      break;
-    case Vector::FRAGMENT:
-      fragment_ = vec;
-      break;
-    case Vector::LIGHT:
-      light_ = vec;
-      break;
-    case Vector::EYE:
-      eye_ = vec;
-      break;
-    case Vector::NORMAL:
-      normal_ = vec;
-      break;
-    case Vector::TANGENT:
-      tangent_ = vec;
-      break;
-    case Vector::BITANGENT:
-      bitangent_ = vec;
-      break;
-    default:
-      break;
-  }
-}
-
-void Shader::SetMat4(int name, Mat4& mat) {
-  switch (name) {
-    case Matrix::MVP:
-      mvp_ = mat;
-      break;
-    default:
-      break;
-  }
-}
-
-void Shader::SetTexture(int name, Texture* texture) {
-  switch (name) {
-    case ETexture::DIFFUSE_TEXTURE:
-      diffuse_texture_ = texture;
-      break;
-    case ETexture::NORMAL_TEXTURE:
-      normal_texture_ = texture;
-      break;
-    case ETexture::NORMAL_TANGENT_TEXTURE:
-      normal_tangent_texture_ = texture;
-      break;
-    case ETexture::SPECULAR_TEXTURE:
-      specular_texture_ = texture;
-      break;
-    default:
-      break;
-  }
-}
-
-void Shader::Vertex(Vec3f& position) {
-  Vec4f homo_vertex{vertex_, 1.f};
-  Vec4f v = mvp_ * homo_vertex;
-
-  position = Vec3f(v[0] / v[3], v[1] / v[3], v[2] / v[3]);
-}
-
-void Shader::Fragment(uint32_t& pixel) {
+template <typename MathT>
+void Shader<MathT>::Vertex(const Uniforms& uniforms,
+                           const Attributes& attributes, Vec4f& position,
+                           Varyings& varyings) {
+  Vec4f homo_vertex{attributes.vertex, 1.f};
+  position = uniforms.mvp * homo_vertex;
+
+  varyings.position = attributes.vertex;
+  varyings.normal = attributes.normal;
+  varyings.tangent = Vec3f{attributes.tangent};
+  varyings.handedness = attributes.tangent.w;
+  varyings.light_dir = uniforms.light - attributes.vertex;
+  varyings.view_dir = uniforms.eye - attributes.vertex;
+  varyings.uv = attributes.texture;
+  // Flipped like the clip coordinates of the renderer
+  varyings.shadow_position = uniforms.shadow_mvp * homo_vertex * -1.f;
+}
+
+template <typename MathT>
+void Shader<MathT>::Fragment(const Uniforms& uniforms,
+                             const Varyings& varyings,
+                             const UvDerivatives& derivatives,
+                             const LightList& /*lights*/, uint32_t& pixel) {
   // Diffuse light intensity
-  Vec3f pixel_normal = Sample(normal_texture_, uv_.u, uv_.v);
-  Vec3f normal = (pixel_normal * 2.f - 255.f).Normalize();
+  Vec3f normal =
+      SampleNormal<MathT>(uniforms, uniforms.normal_texture,
+                          uniforms.normal_map, varyings.uv, derivatives);
 
-  Vec3f light_dir{light_ - fragment_};
+  Vec3f light_dir = MathT::Normalize(varyings.light_dir);
 
-  float diff = std::max(0.f, normal.Normalize() * light_dir.Normalize());
+  float diff = std::max(0.f, normal * light_dir) *
+               ShadowFactor(uniforms, varyings.shadow_position);
 
   // Sampling pixel from diffuse texture
-  Vec3f pixel_diffuse = Sample(diffuse_texture_, uv_.u, uv_.v);
+  Vec3f pixel_diffuse = Sample<MathT>(uniforms, uniforms.diffuse_texture,
+                                      varyings.uv, derivatives);
 
   pixel = GetColor(pixel_diffuse * diff);
 }
 
+template <typename MathT>
+void Shader<MathT>::FragmentBatch(const Uniforms& uniforms,
+                                  const VaryingsBatch& varyings,
+                                  const UvDerivativesBatch& derivatives,
+                                  const LightList& /*lights*/, int mask,
+                                  simd::Int& pixels) {
+  // Diffuse light intensity
+  simd::Vec3 normal =
+      SampleNormal<MathT>(uniforms, uniforms.normal_texture,
+                          uniforms.normal_map, varyings.uv, derivatives, mask);
+
+  simd::Vec3 light_dir = MathT::Normalize(varyings.light_dir);
+
+  simd::Float diff = simd::Max(simd::Set(0.f), simd::Dot(normal, light_dir)) *
+                     ShadowFactor(uniforms, varyings.shadow_position);
+
+  // Sampling pixel from diffuse texture
+  simd::Vec3 pixel_diffuse = Sample<MathT>(uniforms, uniforms.diffuse_texture,
+                                           varyings.uv, derivatives, mask);
+
+  pixels = GetColor(pixel_diffuse * diff);
+}
+
 // Phong Shading
-void PhongShader::Fragment(uint32_t& pixel) {
+template <typename MathT>
+void PhongShader<MathT>::Fragment(const Uniforms& uniforms,
+                                  const Varyings& varyings,
+                                  const UvDerivatives& derivatives,
+                                  const LightList& lights, uint32_t& pixel) {
   // Ambient light intensity
   float ambient = .05f;
 
   // Diffuse light intensity
-  Vec3f pixel_normal = Sample(normal_texture_, uv_.u, uv_.v);
-  Vec3f normal = (pixel_normal * 2.f - 255.f).Normalize();
+  Vec3f normal =
+      SampleNormal<MathT>(uniforms, uniforms.normal_texture,
+                          uniforms.normal_map, varyings.uv, derivatives);
 
-  Vec3f light_dir = (light_ - fragment_).Normalize();
+  Vec3f light_dir = MathT::Normalize(varyings.light_dir);
 
   float diff = std::max(0.f, normal * light_dir);
 
   // Sampling from diffuse texture
-  Vec3f pixel_diffuse = Sample(diffuse_texture_, uv_.u, uv_.v);
-  float intensity = ambient + diff;
+  Vec3f pixel_diffuse = Sample<MathT>(uniforms, uniforms.diffuse_texture,
+                                      varyings.uv, derivatives);
+
+  // Shadows keep the ambient term only
+  float shadow = ShadowFactor(uniforms, varyings.shadow_position);
+  float intensity = ambient + diff * shadow;
 
   // Specular light intensity
-  Vec3f reflect = Reflect(light_dir, normal).Normalize();
-  Vec3f view_dir = (eye_ - fragment_).Normalize();
-  float spec = std::pow(std::max(view_dir * reflect, 0.f), 32.f);
+  Vec3f reflect = MathT::Normalize(Reflect(light_dir, normal));
+  Vec3f view_dir = MathT::Normalize(varyings.view_dir);
+  float spec = MathT::Pow32(std::max(view_dir * reflect, 0.f)) * shadow;
 
-  Vec3f pixel_specular = Sample(specular_texture_, uv_.u, uv_.v);
+  Vec3f pixel_specular = Sample<MathT>(uniforms, uniforms.specular_texture,
+                                       varyings.uv, derivatives);
 
-  pixel = GetColor(pixel_diffuse * intensity + pixel_specular * spec);
+  // Point lights of the tile, in world space like the main light
+  Vec3f color = pixel_diffuse * intensity + pixel_specular * spec;
+  if (lights.count) {
+    color = color + ShadePointLights<MathT>(uniforms, lights, varyings.position,
+                                            normal, view_dir, pixel_diffuse,
+                                            pixel_specular);
+  }
+
+  pixel = GetColor(color);
 }
 
-// Phong Shading wit Normal Mapping in Tangent Space
-void NormalMappingShader::Fragment(uint32_t& pixel) {
+template <typename MathT>
+void PhongShader<MathT>::FragmentBatch(const Uniforms& uniforms,
+                                       const VaryingsBatch& varyings,
+                                       const UvDerivativesBatch& derivatives,
+                                       const LightList& lights, int mask,
+                                       simd::Int& pixels) {
   // Ambient light intensity
-  float ambient = .05f;
+  simd::Float ambient = simd::Set(.05f);
 
   // Diffuse light intensity
-  Vec3f pixel_normal = Sample(normal_tangent_texture_, uv_.u, uv_.v);
-  Vec3f normal = (pixel_normal * 2.f - 255.f).Normalize();
+  simd::Vec3 normal =
+      SampleNormal<MathT>(uniforms, uniforms.normal_texture,
+                          uniforms.normal_map, varyings.uv, derivatives, mask);
+
+  simd::Vec3 light_dir = MathT::Normalize(varyings.light_dir);
+
+  simd::Float diff = simd::Max(simd::Set(0.f), simd::Dot(normal, light_dir));
+
+  // Sampling from diffuse texture
+  simd::Vec3 pixel_diffuse = Sample<MathT>(uniforms, uniforms.diffuse_texture,
+                                           varyings.uv, derivatives, mask);
+
+  // Shadows keep the ambient term only
+  simd::Float shadow = ShadowFactor(uniforms, varyings.shadow_position);
+  simd::Float intensity = ambient + diff * shadow;
+
+  // Specular light intensity
+  simd::Vec3 reflect = MathT::Normalize(Reflect(light_dir, normal));
+  simd::Vec3 view_dir = MathT::Normalize(varyings.view_dir);
+  simd::Float spec =
+      MathT::Pow32(simd::Max(simd::Dot(view_dir, reflect), simd::Set(0.f))) *
+      shadow;
+
+  simd::Vec3 pixel_specular = Sample<MathT>(uniforms, uniforms.specular_texture,
+                                            varyings.uv, derivatives, mask);
+
+  // Point lights of the tile, in world space like the main light
+  simd::Vec3 color = pixel_diffuse * intensity + pixel_specular * spec;
+  if (lights.count) {
+    color = color + ShadePointLights<MathT>(uniforms, lights,
+                                            varyings.position, normal,
+                                            view_dir, pixel_diffuse,
+                                            pixel_specular);
+  }
+
+  pixels = GetColor(color);
+}
+
+// Phong Shading wit Normal Mapping in Tangent Space
+template <typename MathT>
+void NormalMappingShader<MathT>::Vertex(const Uniforms& uniforms,
+                                        const Attributes& attributes,
+                                        Vec4f& position, Varyings& varyings) {
+  Shader<MathT>::Vertex(uniforms, attributes, position, varyings);
 
   // TBN matrix
-  Vec3f T = tangent_.Normalize();
-  Vec3f N = normal_.Normalize();
+  Vec3f N = Vec3f{attributes.normal}.Normalize();
+  Vec3f T = Vec3f{attributes.tangent}.Normalize();
   T = (T - N * (T * N)).Normalize();
-  Vec3f B_ = N ^ T;
+  Vec3f B_ = (N ^ T) * attributes.tangent.w;
 
-  Mat3 TBN{};
-  TBN[0][0] = T.x;
-  TBN[1][0] = T.y;
-  TBN[2][0] = T.z;
-  TBN[0][1] = B_.x;
-  TBN[1][1] = B_.y;
-  TBN[2][1] = B_.z;
-  TBN[0][2] = N.x;
-  TBN[1][2] = N.y;
-  TBN[2][2] = N.z;
+  // Into tangent space, the rows of TBN are T, B and N, interpolated
+  // vectors stay close enough to the per-pixel frame
+  auto tbn = [&](const Vec3f& v) { return Vec3f{T * v, B_ * v, N * v}; };
+  varyings.light_dir = tbn(varyings.light_dir);
+  varyings.view_dir = tbn(varyings.view_dir);
+}
 
-  Vec3f light_pos = TBN * light_;
-  Vec3f view_pos = TBN * eye_;
-  Vec3f fragment_pos = TBN * fragment_;
+template <typename MathT>
+void NormalMappingShader<MathT>::Fragment(const Uniforms& uniforms,
+                                          const Varyings& varyings,
+                                          const UvDerivatives& derivatives,
+                                          const LightList& lights,
+                                          uint32_t& pixel) {
+  // Ambient light intensity
+  float ambient = .05f;
 
-  Vec3f light_dir = (light_pos - fragment_pos).Normalize();
+  // Every map at uv, from the material texture in one fetch when bound
+  Vec3f normal;
+  Vec3f pixel_diffuse;
+  Vec3f pixel_specular;
+  if (uniforms.material_texture) {
+    MaterialSample material = SampleMaterial<MathT>(
+        uniforms, uniforms.material_texture, varyings.uv, derivatives);
+    normal = material.normal;
+    pixel_diffuse = material.diffuse;
+    pixel_specular = material.specular;
+  } else {
+    normal = SampleNormal<MathT>(uniforms, uniforms.normal_tangent_texture,
+                                 uniforms.normal_tangent_map, varyings.uv,
+                                 derivatives);
+    pixel_diffuse = Sample<MathT>(uniforms, uniforms.diffuse_texture,
+                                  varyings.uv, derivatives);
+    pixel_specular = Sample<MathT>(uniforms, uniforms.specular_texture,
+                                   varyings.uv, derivatives);
+  }
+
+  // Diffuse light intensity
+  Vec3f light_dir = MathT::Normalize(varyings.light_dir);
 
   float diff = std::max(0.f, normal * light_dir);
 
-  // Sampling from diffuse texture
-  Vec3f pixel_diffuse = Sample(diffuse_texture_, uv_.u, uv_.v);
-  float intensity = ambient + diff;
+  // Shadows keep the ambient term only
+  float shadow = ShadowFactor(uniforms, varyings.shadow_position);
+  float intensity = ambient + diff * shadow;
+
+  // Specular light intensity
+  Vec3f reflect = MathT::Normalize(Reflect(light_dir, normal));
+  Vec3f view_dir = MathT::Normalize(varyings.view_dir);
+  float spec = MathT::Pow32(std::max(view_dir * reflect, 0.f)) * shadow;
+
+  Vec3f color = pixel_diffuse * intensity + pixel_specular * spec;
+  if (lights.count) {
+    // Point lights of the tile are shaded in world space, bring the normal
+    // out of tangent space
+    Vec3f N = MathT::Normalize(varyings.normal);
+    Vec3f T = MathT::Normalize(varyings.tangent);
+    T = MathT::Normalize(T - N * (T * N));
+    Vec3f B_ = (N ^ T) * varyings.handedness;
+    Vec3f world_normal =
+        MathT::Normalize(T * normal.x + B_ * normal.y + N * normal.z);
+    Vec3f world_view_dir = MathT::Normalize(uniforms.eye - varyings.position);
+
+    color = color + ShadePointLights<MathT>(uniforms, lights, varyings.position,
+                                            world_normal, world_view_dir,
+                                            pixel_diffuse, pixel_specular);
+  }
+
+  pixel = GetColor(color);
+}
+
+template <typename MathT>
+void NormalMappingShader<MathT>::FragmentBatch(
+    const Uniforms& uniforms, const VaryingsBatch& varyings,
+    const UvDerivativesBatch& derivatives, const LightList& lights, int mask,
+    simd::Int& pixels) {
+  // Ambient light intensity
+  simd::Float ambient = simd::Set(.05f);
+
+  // Every map at uv, from the material texture in one fetch when bound
+  simd::Vec3 normal;
+  simd::Vec3 pixel_diffuse;
+  simd::Vec3 pixel_specular;
+  if (uniforms.material_texture) {
+    MaterialSampleBatch material =
+        SampleMaterial<MathT>(uniforms, uniforms.material_texture, varyings.uv,
+                              derivatives, mask);
+    normal = material.normal;
+    pixel_diffuse = material.diffuse;
+    pixel_specular = material.specular;
+  } else {
+    normal = SampleNormal<MathT>(uniforms, uniforms.normal_tangent_texture,
+                                 uniforms.normal_tangent_map, varyings.uv,
+                                 derivatives, mask);
+    pixel_diffuse = Sample<MathT>(uniforms, uniforms.diffuse_texture,
+                                  varyings.uv, derivatives, mask);
+    pixel_specular = Sample<MathT>(uniforms, uniforms.specular_texture,
+                                   varyings.uv, derivatives, mask);
+  }
+
+  // Diffuse light intensity
+  simd::Vec3 light_dir = MathT::Normalize(varyings.light_dir);
+
+  simd::Float diff = simd::Max(simd::Set(0.f), simd::Dot(normal, light_dir));
+
+  // Shadows keep the ambient term only
+  simd::Float shadow = ShadowFactor(uniforms, varyings.shadow_position);
+  simd::Float intensity = ambient + diff * shadow;
 
   // Specular light intensity
-  Vec3f reflect = Reflect(light_dir, normal).Normalize();
-  Vec3f view_dir = (view_pos - fragment_pos).Normalize();
-  float spec = std::pow(std::max(view_dir * reflect, 0.f), 32.f);
-  Vec3f pixel_specular = Sample(specular_texture_, uv_.u, uv_.v);
+  simd::Vec3 reflect = MathT::Normalize(Reflect(light_dir, normal));
+  simd::Vec3 view_dir = MathT::Normalize(varyings.view_dir);
+  simd::Float spec =
+      MathT::Pow32(simd::Max(simd::Dot(view_dir, reflect), simd::Set(0.f))) *
+      shadow;
+
+  simd::Vec3 color = pixel_diffuse * intensity + pixel_specular * spec;
+  if (lights.count) {
+    // Point lights of the tile are shaded in world space, bring the normal
+    // out of tangent space
+    simd::Vec3 N = MathT::Normalize(varyings.normal);
+    simd::Vec3 T = MathT::Normalize(varyings.tangent);
+    T = MathT::Normalize(T - N * simd::Dot(T, N));
+    simd::Vec3 B_ = simd::Cross(N, T) * varyings.handedness;
+    simd::Vec3 world_normal =
+        MathT::Normalize(T * normal.x + B_ * normal.y + N * normal.z);
+    const Vec3f& eye = uniforms.eye;
+    simd::Vec3 world_view_dir = MathT::Normalize(
+        simd::Set(eye.x, eye.y, eye.z) - varyings.position);
+
+    color = color + ShadePointLights<MathT>(uniforms, lights,
+                                            varyings.position, world_normal,
+                                            world_view_dir, pixel_diffuse,
+                                            pixel_specular);
+  }
+
+  pixels = GetColor(color);
+}
 
-  pixel = GetColor(pixel_diffuse * intensity + pixel_specular * spec);
+Vec2i TexelCoords(const Texture* texture, const Vec2f& uv) {
+  return Vec2i{
+      static_cast<int>(
+          std::round(uv.u * static_cast<float>(texture->GetWidth()))),
+      static_cast<int>(
+          std::round(uv.v * static_cast<float>(texture->GetHeight())))};
 }
 
+void TexelCoords(const Texture* texture, const simd::Vec2& uv, int mask,
+                 int* u, int* v) {
+  float uv_u[simd::LANES];
+  float uv_v[simd::LANES];
+  simd::Store(uv_u, uv.x);
+  simd::Store(uv_v, uv.y);
+
+  for (int lane = 0; lane < simd::LANES; ++lane) {
+    Vec2i coords{};
+    if (mask >> lane & 1) {
+      coords = TexelCoords(texture, Vec2f{uv_u[lane], uv_v[lane]});
+    }
+    u[lane] = coords.u;
+    v[lane] = coords.v;
+  }
+}
+
+namespace {
+
+// Nearest texels of uv per lane, the texels TexelCoords and Sample pick.
+// Rounded half up and clamped before converting, so that every lane, masked
+// or not, lands inside the level
+void NearestTexels(const simd::Vec2& uv, int width, int height, simd::Int& x,
+                   simd::Int& y) {
+  simd::Float w = simd::Set(static_cast<float>(width));
+  simd::Float h = simd::Set(static_cast<float>(height));
+  simd::Float zero = simd::Set(0.f);
+  simd::Float half = simd::Set(.5f);
+
+  x = simd::Truncate(simd::Min(simd::Max(uv.x * w + half, zero), w - half));
+  // Rows are stored top-down
+  simd::Float v = simd::ToFloat(simd::Truncate(
+      simd::Min(simd::Max(uv.y * h + half, zero), h + half)));
+  y = simd::Truncate(simd::Min(simd::Max(h - v, zero), h - simd::Set(1.f)));
+}
+
+// Indices of texels in the 32-bit words of an uncompressed level
+simd::Int TexelIndices(const MipLevel& level, simd::Int x, simd::Int y) {
+  if (level.layout == ETextureLayout::LINEAR_LAYOUT) {
+    return x + y * simd::Set(level.width);
+  }
+
+  simd::Int mask = simd::Set(TEXTURE_TILE_SIZE - 1);
+  simd::Int tile = (x >> TEXTURE_TILE_BITS) +
+                   (y >> TEXTURE_TILE_BITS) * simd::Set(level.tiles_per_row);
+  simd::Int texel = (x & mask) + ((y & mask) << TEXTURE_TILE_BITS);
+  return (tile << 2 * TEXTURE_TILE_BITS) + texel;
+}
+
+const int32_t* TexelWords(const MipLevel& level) {
+  return reinterpret_cast<const int32_t*>(level.data);
+}
+
+// Red, green and blue of RGBA8 words
+simd::Vec3 UnpackTexels(simd::Int texels) {
+  simd::Int byte = simd::Set(255);
+  return {simd::ToFloat(texels & byte), simd::ToFloat(texels >> 8 & byte),
+          simd::ToFloat(texels >> 16 & byte)};
+}
+
+simd::Vec3 Select(simd::Int mask, const simd::Vec3& a, const simd::Vec3& b) {
+  return {simd::Select(mask, a.x, b.x), simd::Select(mask, a.y, b.y),
+          simd::Select(mask, a.z, b.z)};
+}
+
+// Texels around uv per lane and the fractions between them, as in the
+// scalar SampleBilinear
+struct BilinearFootprint {
+  simd::Int x0;
+  simd::Int y0;
+  simd::Int x1;
+  simd::Int y1;
+  simd::Float fx;
+  simd::Float fy;
+};
+
+BilinearFootprint GetBilinearFootprint(const simd::Vec2& uv, int width,
+                                       int height) {
+  simd::Float w = simd::Set(static_cast<float>(width));
+  simd::Float h = simd::Set(static_cast<float>(height));
+  simd::Float zero = simd::Set(0.f);
+  simd::Float one = simd::Set(1.f);
+  simd::Float half = simd::Set(.5f);
+
+  // Texel centers at half-integers, v grows upwards while rows go down.
+  // Bounded so that truncation cannot overflow, the clamps below agree
+  simd::Float x = simd::Min(simd::Max(uv.x * w - half, simd::Set(-1.f)), w);
+  simd::Float y =
+      simd::Min(simd::Max((one - uv.y) * h - half, simd::Set(-1.f)), h);
+  // Floor, truncation rounds negative values up
+  simd::Float x_floor = simd::ToFloat(simd::Truncate(x));
+  simd::Float y_floor = simd::ToFloat(simd::Truncate(y));
+  x_floor = x_floor - one + simd::Step(x_floor, x);
+  y_floor = y_floor - one + simd::Step(y_floor, y);
+
+  // Clamp to edge
+  return {simd::Truncate(simd::Min(simd::Max(x_floor, zero), w - one)),
+          simd::Truncate(simd::Min(simd::Max(y_floor, zero), h - one)),
+          simd::Truncate(simd::Min(simd::Max(x_floor + one, zero), w - one)),
+          simd::Truncate(simd::Min(simd::Max(y_floor + one, zero), h - one)),
+          x - x_floor, y - y_floor};
+}
+
+// Weights of the four texels of footprint with 8-bit fractions, they sum to
+// 1 << 16 so that sums of weighted 8 to 11-bit fields stay exact in 32 bits
+void GetBilinearWeights(const BilinearFootprint& footprint,
+                        simd::Int* weights) {
+  simd::Float scale = simd::Set(256.f);
+  simd::Float half = simd::Set(.5f);
+  simd::Int fx = simd::Truncate(footprint.fx * scale + half);
+  simd::Int fy = simd::Truncate(footprint.fy * scale + half);
+  simd::Int gx = simd::Set(256) - fx;
+  simd::Int gy = simd::Set(256) - fy;
+  weights[0] = gx * gy;
+  weights[1] = fx * gy;
+  weights[2] = gx * fy;
+  weights[3] = fx * fy;
+}
+
+// Filtered texels of the lanes in mask, from sample_level(level) of the mip
+// levels picked by uniforms.texture_filter, initial elsewhere. Lanes of a
+// quad share their levels, so a block rarely needs more than two passes
+template <typename MathT, typename TextureT, typename SampleLevel>
+simd::Vec3 SampleLevels(const Uniforms& uniforms, const TextureT* texture,
+                        const UvDerivativesBatch& derivatives, int mask,
+                        const simd::Vec3& initial,
+                        const SampleLevel& sample_level) {
+  float lanes[4][simd::LANES];
+  simd::Store(lanes[0], derivatives.dx.x);
+  simd::Store(lanes[1], derivatives.dx.y);
+  simd::Store(lanes[2], derivatives.dy.x);
+  simd::Store(lanes[3], derivatives.dy.y);
+
+  // Level and trilinear blend per lane, -1 outside mask
+  bool trilinear = uniforms.texture_filter == ETextureFilter::TRILINEAR_FILTER;
+  int levels_count = texture->GetLevelsCount();
+  int levels[simd::LANES];
+  float blends[simd::LANES] = {};
+  for (int lane = 0; lane < simd::LANES; ++lane) {
+    levels[lane] = -1;
+    if (mask >> lane & 1) {
+      UvDerivatives lane_derivatives{Vec2f{lanes[0][lane], lanes[1][lane]},
+                                     Vec2f{lanes[2][lane], lanes[3][lane]}};
+      float lod =
+          std::clamp(LevelOfDetail<MathT>(texture, lane_derivatives), 0.f,
+                     static_cast<float>(levels_count - 1));
+      if (!trilinear) {
+        levels[lane] = static_cast<int>(lod + .5f);
+      } else if (levels_count > 1) {
+        levels[lane] = std::min(static_cast<int>(lod), levels_count - 2);
+        blends[lane] = lod - static_cast<float>(levels[lane]);
+      } else {
+        levels[lane] = 0;
+      }
+    }
+  }
+
+  simd::Int lane_levels = simd::Load(levels);
+  simd::Float blend = simd::Load(blends);
+  simd::Vec3 color = initial;
+  for (int pending = mask; pending;) {
+    int lane = 0;
+    while (!(pending >> lane & 1)) {
+      ++lane;
+    }
+    int level = levels[lane];
+    simd::Int same = lane_levels == simd::Set(level);
+
+    simd::Vec3 texels = sample_level(level);
+    if (trilinear && level + 1 < levels_count) {
+      simd::Vec3 coarse = sample_level(level + 1);
+      texels = texels + (coarse - texels) * blend;
+    }
+    color = Select(same, texels, color);
+
+    pending &= ~simd::MoveMask(same);
+  }
+
+  return color;
+}
+
+}  // namespace
+
 Vec3f Sample(Texture* surface, int x, int y) {
-  uint8_t* imageData = surface->GetData();
+  // Rows are stored top-down, clamped to the edges
+  const MipLevel& level = surface->GetLevel(0);
+  const uint8_t* texel =
+      level.Fetch(std::clamp(x, 0, level.width - 1),
+                  std::clamp(level.height - y, 0, level.height - 1));
+
+  return Vec3f(static_cast<float>(texel[0]), static_cast<float>(texel[1]),
+               static_cast<float>(texel[2]));
+}
+
+simd::Vec3 Sample(Texture* surface, const int* x, const int* y, int mask) {
+  float r[simd::LANES] = {};
+  float g[simd::LANES] = {};
+  float b[simd::LANES] = {};
+
+  for (int lane = 0; lane < simd::LANES; ++lane) {
+    if (mask >> lane & 1) {
+      Vec3f texel = Sample(surface, x[lane], y[lane]);
+      r[lane] = texel.x;
+      g[lane] = texel.y;
+      b[lane] = texel.z;
+    }
+  }
+
+  return {simd::Load(r), simd::Load(g), simd::Load(b)};
+}
+
+template <typename MathT>
+Vec3f Sample(const Uniforms& uniforms, Texture* texture, const Vec2f& uv,
+             const UvDerivatives& derivatives) {
+  if (uniforms.texture_filter == ETextureFilter::NEAREST_FILTER) {
+    Vec2i texel = TexelCoords(texture, uv);
+    return Sample(texture, texel.u, texel.v);
+  }
+
+  float max_level = static_cast<float>(texture->GetLevelsCount() - 1);
+  float lod =
+      std::clamp(LevelOfDetail<MathT>(texture, derivatives), 0.f, max_level);
+
+  if (uniforms.texture_filter == ETextureFilter::BILINEAR_FILTER) {
+    return SampleBilinear(texture->GetLevel(static_cast<int>(lod + .5f)), uv);
+  }
+
+  // Blend the levels on both sides of lod
+  int level = std::min(static_cast<int>(lod), texture->GetLevelsCount() - 2);
+  if (level < 0) {
+    return SampleBilinear(texture->GetLevel(0), uv);
+  }
+  float t = lod - static_cast<float>(level);
+  Vec3f fine = SampleBilinear(texture->GetLevel(level), uv);
+  Vec3f coarse = SampleBilinear(texture->GetLevel(level + 1), uv);
+  return fine + (coarse - fine) * t;
+}
+
+template <typename MathT>
+simd::Vec3 Sample(const Uniforms& uniforms, Texture* texture,
+                  const simd::Vec2& uv, const UvDerivativesBatch& derivatives,
+                  int mask) {
+  // Compressed blocks are decoded per lane through the block cache and
+  // virtual pages are looked up per lane, others are gathered
+  bool addressable = texture->GetLevel(0).IsAddressable();
+
+  if (uniforms.texture_filter == ETextureFilter::NEAREST_FILTER) {
+    if (!addressable) {
+      int u[simd::LANES];
+      int v[simd::LANES];
+      TexelCoords(texture, uv, mask, u, v);
+      return Sample(texture, u, v, mask);
+    }
+
+    const MipLevel& level = texture->GetLevel(0);
+    simd::Int x;
+    simd::Int y;
+    NearestTexels(uv, level.width, level.height, x, y);
+    return UnpackTexels(
+        simd::Gather(TexelWords(level), TexelIndices(level, x, y)));
+  }
+
+  if (!addressable) {
+    float lanes[6][simd::LANES];
+    simd::Store(lanes[0], uv.x);
+    simd::Store(lanes[1], uv.y);
+    simd::Store(lanes[2], derivatives.dx.x);
+    simd::Store(lanes[3], derivatives.dx.y);
+    simd::Store(lanes[4], derivatives.dy.x);
+    simd::Store(lanes[5], derivatives.dy.y);
+
+    float r[simd::LANES] = {};
+    float g[simd::LANES] = {};
+    float b[simd::LANES] = {};
+    for (int lane = 0; lane < simd::LANES; ++lane) {
+      if (mask >> lane & 1) {
+        Vec2f lane_uv{lanes[0][lane], lanes[1][lane]};
+        UvDerivatives lane_derivatives{Vec2f{lanes[2][lane], lanes[3][lane]},
+                                       Vec2f{lanes[4][lane], lanes[5][lane]}};
+        Vec3f texel =
+            Sample<MathT>(uniforms, texture, lane_uv, lane_derivatives);
+        r[lane] = texel.x;
+        g[lane] = texel.y;
+        b[lane] = texel.z;
+      }
+    }
 
-  uint8_t r =
-      imageData[4 * ((surface->GetHeight() - y) * surface->GetWidth() + x) + 0];
-  uint8_t g =
-      imageData[4 * ((surface->GetHeight() - y) * surface->GetWidth() + x) + 1];
-  uint8_t b =
-      imageData[4 * ((surface->GetHeight() - y) * surface->GetWidth() + x) + 2];
+    return {simd::Load(r), simd::Load(g), simd::Load(b)};
+  }
+
+  return SampleLevels<MathT>(
+      uniforms, texture, derivatives, mask, simd::Set(0.f, 0.f, 0.f),
+      [&](int level) { return SampleBilinear(texture->GetLevel(level), uv); });
+}
+
+simd::Vec3 SampleBilinear(const MipLevel& level, const simd::Vec2& uv) {
+  BilinearFootprint footprint =
+      GetBilinearFootprint(uv, level.width, level.height);
+
+  const int32_t* words = TexelWords(level);
+  auto gather = [&](simd::Int x, simd::Int y) {
+    return simd::Gather(words, TexelIndices(level, x, y));
+  };
+  simd::Int texels[4] = {gather(footprint.x0, footprint.y0),
+                         gather(footprint.x1, footprint.y0),
+                         gather(footprint.x0, footprint.y1),
+                         gather(footprint.x1, footprint.y1)};
+
+  // A weighted channel stays below 1 << 24, exact once converted
+  simd::Int weights[4];
+  GetBilinearWeights(footprint, weights);
+
+  simd::Int byte = simd::Set(255);
+  auto channel = [&](int shift) {
+    simd::Int sum = simd::Set(0);
+    for (int i = 0; i < 4; ++i) {
+      sum = sum + (texels[i] >> shift & byte) * weights[i];
+    }
+    return simd::ToFloat(sum) * simd::Set(1.f / 65536.f);
+  };
+
+  return {channel(0), channel(8), channel(16)};
+}
+
+Vec3f SampleBilinear(const MipLevel& level, const Vec2f& uv) {
+  // Texel centers at half-integers, v grows upwards while rows go down
+  float x = uv.u * static_cast<float>(level.width) - .5f;
+  float y = (1.f - uv.v) * static_cast<float>(level.height) - .5f;
+  float x_floor = std::floor(x);
+  float y_floor = std::floor(y);
+  float fx = x - x_floor;
+  float fy = y - y_floor;
+
+  // Clamp to edge
+  int x0 = std::clamp(static_cast<int>(x_floor), 0, level.width - 1);
+  int y0 = std::clamp(static_cast<int>(y_floor), 0, level.height - 1);
+  int x1 = std::min(std::max(static_cast<int>(x_floor) + 1, 0),
+                    level.width - 1);
+  int y1 = std::min(std::max(static_cast<int>(y_floor) + 1, 0),
+                    level.height - 1);
+
+  auto texel = [&](int x, int y) {
+    const uint8_t* p = level.Fetch(x, y);
+    return Vec3f(static_cast<float>(p[0]), static_cast<float>(p[1]),
+                 static_cast<float>(p[2]));
+  };
+
+  Vec3f top = texel(x0, y0) + (texel(x1, y0) - texel(x0, y0)) * fx;
+  Vec3f bottom = texel(x0, y1) + (texel(x1, y1) - texel(x0, y1)) * fx;
+  return top + (bottom - top) * fy;
+}
+
+namespace {
 
-  return Vec3f(r, g, b);
+// Vector of texel, unit up to the quantization
+Vec3f DecodeNormal(const NormalTexel& texel) {
+  float x = static_cast<float>(texel.bits & 2047);
+  float y = static_cast<float>(texel.bits >> 11 & 2047);
+  float z = static_cast<float>(texel.bits >> 22);
+  return Vec3f(x * (1.f / NORMAL_XY_SCALE) - 1.f,
+               y * (1.f / NORMAL_XY_SCALE) - 1.f,
+               z * (1.f / NORMAL_Z_SCALE) - 1.f);
 }
 
-Vec3f Reflect(Vec3f& v, Vec3f& normal) {
+// Same footprint as SampleBilinear, unnormalized
+Vec3f SampleNormalBilinear(const NormalLevel& level, const Vec2f& uv) {
+  float x = uv.u * static_cast<float>(level.width) - .5f;
+  float y = (1.f - uv.v) * static_cast<float>(level.height) - .5f;
+  float x_floor = std::floor(x);
+  float y_floor = std::floor(y);
+  float fx = x - x_floor;
+  float fy = y - y_floor;
+
+  int x0 = std::clamp(static_cast<int>(x_floor), 0, level.width - 1);
+  int y0 = std::clamp(static_cast<int>(y_floor), 0, level.height - 1);
+  int x1 = std::min(std::max(static_cast<int>(x_floor) + 1, 0),
+                    level.width - 1);
+  int y1 = std::min(std::max(static_cast<int>(y_floor) + 1, 0),
+                    level.height - 1);
+
+  Vec3f texel00 = DecodeNormal(level.Texel(x0, y0));
+  Vec3f texel10 = DecodeNormal(level.Texel(x1, y0));
+  Vec3f texel01 = DecodeNormal(level.Texel(x0, y1));
+  Vec3f texel11 = DecodeNormal(level.Texel(x1, y1));
+  Vec3f top = texel00 + (texel10 - texel00) * fx;
+  Vec3f bottom = texel01 + (texel11 - texel01) * fx;
+  return top + (bottom - top) * fy;
+}
+
+// Fields of NormalTexel words, or sums of them weighted by weights summing
+// to weight
+simd::Vec3 DecodeNormals(simd::Int x, simd::Int y, simd::Int z,
+                         float weight) {
+  simd::Float one = simd::Set(1.f);
+  return {simd::ToFloat(x) * simd::Set(1.f / (NORMAL_XY_SCALE * weight)) - one,
+          simd::ToFloat(y) * simd::Set(1.f / (NORMAL_XY_SCALE * weight)) - one,
+          simd::ToFloat(z) * simd::Set(1.f / (NORMAL_Z_SCALE * weight)) - one};
+}
+
+simd::Int GatherNormals(const NormalLevel& level, simd::Int x, simd::Int y) {
+  return simd::Gather(reinterpret_cast<const int32_t*>(level.data),
+                      x + y * simd::Set(level.width));
+}
+
+// Unnormalized like the scalar SampleNormalBilinear, the fields are filtered
+// in fixed point like the channels of SampleBilinear
+simd::Vec3 SampleNormalBilinear(const NormalLevel& level,
+                                const simd::Vec2& uv) {
+  BilinearFootprint footprint =
+      GetBilinearFootprint(uv, level.width, level.height);
+  simd::Int texels[4] = {GatherNormals(level, footprint.x0, footprint.y0),
+                         GatherNormals(level, footprint.x1, footprint.y0),
+                         GatherNormals(level, footprint.x0, footprint.y1),
+                         GatherNormals(level, footprint.x1, footprint.y1)};
+  simd::Int weights[4];
+  GetBilinearWeights(footprint, weights);
+
+  simd::Int x = simd::Set(0);
+  simd::Int y = simd::Set(0);
+  simd::Int z = simd::Set(0);
+  simd::Int field = simd::Set(2047);
+  for (int i = 0; i < 4; ++i) {
+    x = x + (texels[i] & field) * weights[i];
+    y = y + (texels[i] >> 11 & field) * weights[i];
+    z = z + (texels[i] >> 22) * weights[i];
+  }
+  return DecodeNormals(x, y, z, 65536.f);
+}
+
+}  // namespace
+
+template <typename MathT>
+Vec3f SampleNormal(const Uniforms& uniforms, Texture* texture,
+                   const NormalMap* map, const Vec2f& uv,
+                   const UvDerivatives& derivatives) {
+  if (!map) {
+    Vec3f texel = Sample<MathT>(uniforms, texture, uv, derivatives);
+    return MathT::Normalize(texel * 2.f - 255.f);
+  }
+
+  if (uniforms.texture_filter == ETextureFilter::NEAREST_FILTER) {
+    // Same texel as Sample, unit as it is
+    const NormalLevel& level = map->GetLevel(0);
+    int x =
+        static_cast<int>(std::round(uv.u * static_cast<float>(level.width)));
+    int y =
+        static_cast<int>(std::round(uv.v * static_cast<float>(level.height)));
+    return DecodeNormal(
+        level.Texel(std::clamp(x, 0, level.width - 1),
+                    std::clamp(level.height - y, 0, level.height - 1)));
+  }
+
+  // Blends of unit vectors are shorter, normalized once at the end
+  float max_level = static_cast<float>(map->GetLevelsCount() - 1);
+  float lod =
+      std::clamp(LevelOfDetail<MathT>(map, derivatives), 0.f, max_level);
+
+  if (uniforms.texture_filter == ETextureFilter::BILINEAR_FILTER) {
+    return MathT::Normalize(SampleNormalBilinear(
+        map->GetLevel(static_cast<int>(lod + .5f)), uv));
+  }
+
+  int level = std::min(static_cast<int>(lod), map->GetLevelsCount() - 2);
+  if (level < 0) {
+    return MathT::Normalize(SampleNormalBilinear(map->GetLevel(0), uv));
+  }
+  float t = lod - static_cast<float>(level);
+  Vec3f fine = SampleNormalBilinear(map->GetLevel(level), uv);
+  Vec3f coarse = SampleNormalBilinear(map->GetLevel(level + 1), uv);
+  return MathT::Normalize(fine + (coarse - fine) * t);
+}
+
+template <typename MathT>
+simd::Vec3 SampleNormal(const Uniforms& uniforms, Texture* texture,
+                        const NormalMap* map, const simd::Vec2& uv,
+                        const UvDerivativesBatch& derivatives, int mask) {
+  if (!map) {
+    simd::Vec3 texels = Sample<MathT>(uniforms, texture, uv, derivatives, mask);
+    return MathT::Normalize(texels * simd::Set(2.f) -
+                            simd::Set(255.f, 255.f, 255.f));
+  }
+
+  if (uniforms.texture_filter == ETextureFilter::NEAREST_FILTER) {
+    const NormalLevel& level = map->GetLevel(0);
+    simd::Int x;
+    simd::Int y;
+    NearestTexels(uv, level.width, level.height, x, y);
+    simd::Int texels = GatherNormals(level, x, y);
+    return DecodeNormals(texels & simd::Set(2047),
+                         texels >> 11 & simd::Set(2047), texels >> 22, 1.f);
+  }
+
+  // Lanes outside mask keep a unit normal
+  auto sample_level = [&](int level) {
+    return SampleNormalBilinear(map->GetLevel(level), uv);
+  };
+  return MathT::Normalize(SampleLevels<MathT>(uniforms, map, derivatives,
+                                              mask, simd::Set(0.f, 0.f, 1.f),
+                                              sample_level));
+}
+
+namespace {
+
+// Material texels are filtered as diffuse rgb, normal xy and specular
+const int MATERIAL_CHANNELS = 6;
+
+void FetchMaterial(const MaterialLevel& level, int x, int y, float* channels) {
+  const MaterialTexel& texel = level.Texel(x, y);
+  channels[0] = static_cast<float>(texel.diffuse[0]);
+  channels[1] = static_cast<float>(texel.diffuse[1]);
+  channels[2] = static_cast<float>(texel.diffuse[2]);
+  channels[3] = static_cast<float>(texel.normal[0]);
+  channels[4] = static_cast<float>(texel.normal[1]);
+  channels[5] = static_cast<float>(texel.specular);
+}
+
+// Same footprint as SampleBilinear
+void SampleMaterialBilinear(const MaterialLevel& level, const Vec2f& uv,
+                            float* channels) {
+  float x = uv.u * static_cast<float>(level.width) - .5f;
+  float y = (1.f - uv.v) * static_cast<float>(level.height) - .5f;
+  float x_floor = std::floor(x);
+  float y_floor = std::floor(y);
+  float fx = x - x_floor;
+  float fy = y - y_floor;
+
+  int x0 = std::clamp(static_cast<int>(x_floor), 0, level.width - 1);
+  int y0 = std::clamp(static_cast<int>(y_floor), 0, level.height - 1);
+  int x1 = std::min(std::max(static_cast<int>(x_floor) + 1, 0),
+                    level.width - 1);
+  int y1 = std::min(std::max(static_cast<int>(y_floor) + 1, 0),
+                    level.height - 1);
+
+  float texels[4][MATERIAL_CHANNELS];
+  FetchMaterial(level, x0, y0, texels[0]);
+  FetchMaterial(level, x1, y0, texels[1]);
+  FetchMaterial(level, x0, y1, texels[2]);
+  FetchMaterial(level, x1, y1, texels[3]);
+
+  for (int c = 0; c < MATERIAL_CHANNELS; ++c) {
+    float top = texels[0][c] + (texels[1][c] - texels[0][c]) * fx;
+    float bottom = texels[2][c] + (texels[3][c] - texels[2][c]) * fx;
+    channels[c] = top + (bottom - top) * fy;
+  }
+}
+
+// Normal z is rebuilt after filtering, which puts the normal back on the
+// unit sphere without normalizing it
+MaterialSample DecodeMaterial(const float* channels) {
+  float x = channels[3] / 127.5f - 1.f;
+  float y = channels[4] / 127.5f - 1.f;
+  float xy2 = x * x + y * y;
+  Vec3f normal(x, y, 0.f);
+  if (xy2 < 1.f) {
+    normal.z = std::sqrt(1.f - xy2);
+  } else {
+    // Rounded outside of the unit circle
+    normal = normal * (1.f / std::sqrt(xy2));
+  }
+
+  return {Vec3f(channels[0], channels[1], channels[2]), normal,
+          Vec3f(channels[5], channels[5], channels[5])};
+}
+
+}  // namespace
+
+template <typename MathT>
+MaterialSample SampleMaterial(const Uniforms& uniforms,
+                              const MaterialTexture* material,
+                              const Vec2f& uv,
+                              const UvDerivatives& derivatives) {
+  float channels[MATERIAL_CHANNELS];
+
+  if (uniforms.texture_filter == ETextureFilter::NEAREST_FILTER) {
+    // Same texel as Sample
+    const MaterialLevel& level = material->GetLevel(0);
+    int x =
+        static_cast<int>(std::round(uv.u * static_cast<float>(level.width)));
+    int y =
+        static_cast<int>(std::round(uv.v * static_cast<float>(level.height)));
+    FetchMaterial(level, std::clamp(x, 0, level.width - 1),
+                  std::clamp(level.height - y, 0, level.height - 1), channels);
+    return DecodeMaterial(channels);
+  }
+
+  float max_level = static_cast<float>(material->GetLevelsCount() - 1);
+  float lod =
+      std::clamp(LevelOfDetail<MathT>(material, derivatives), 0.f, max_level);
+
+  if (uniforms.texture_filter == ETextureFilter::BILINEAR_FILTER) {
+    SampleMaterialBilinear(material->GetLevel(static_cast<int>(lod + .5f)),
+                           uv, channels);
+    return DecodeMaterial(channels);
+  }
+
+  // Blend the levels on both sides of lod
+  int level = std::min(static_cast<int>(lod), material->GetLevelsCount() - 2);
+  if (level < 0) {
+    SampleMaterialBilinear(material->GetLevel(0), uv, channels);
+    return DecodeMaterial(channels);
+  }
+  float t = lod - static_cast<float>(level);
+  float coarse[MATERIAL_CHANNELS];
+  SampleMaterialBilinear(material->GetLevel(level), uv, channels);
+  SampleMaterialBilinear(material->GetLevel(level + 1), uv, coarse);
+  for (int c = 0; c < MATERIAL_CHANNELS; ++c) {
+    channels[c] += (coarse[c] - channels[c]) * t;
+  }
+  return DecodeMaterial(channels);
+}
+
+template <typename MathT>
+MaterialSampleBatch SampleMaterial(const Uniforms& uniforms,
+                                   const MaterialTexture* material,
+                                   const simd::Vec2& uv,
+                                   const UvDerivativesBatch& derivatives,
+                                   int mask) {
+  float lanes[6][simd::LANES];
+  simd::Store(lanes[0], uv.x);
+  simd::Store(lanes[1], uv.y);
+  simd::Store(lanes[2], derivatives.dx.x);
+  simd::Store(lanes[3], derivatives.dx.y);
+  simd::Store(lanes[4], derivatives.dy.x);
+  simd::Store(lanes[5], derivatives.dy.y);
+
+  // Diffuse, normal and specular per lane
+  float channels[9][simd::LANES] = {};
+  for (int lane = 0; lane < simd::LANES; ++lane) {
+    if (mask >> lane & 1) {
+      Vec2f lane_uv{lanes[0][lane], lanes[1][lane]};
+      UvDerivatives lane_derivatives{Vec2f{lanes[2][lane], lanes[3][lane]},
+                                     Vec2f{lanes[4][lane], lanes[5][lane]}};
+      MaterialSample sample = SampleMaterial<MathT>(uniforms, material,
+                                                    lane_uv, lane_derivatives);
+      for (int c = 0; c < 3; ++c) {
+        channels[c][lane] = sample.diffuse[c];
+        channels[3 + c][lane] = sample.normal[c];
+        channels[6 + c][lane] = sample.specular[c];
+      }
+    }
+  }
+
+  return {{simd::Load(channels[0]), simd::Load(channels[1]),
+           simd::Load(channels[2])},
+          {simd::Load(channels[3]), simd::Load(channels[4]),
+           simd::Load(channels[5])},
+          {simd::Load(channels[6]), simd::Load(channels[7]),
+           simd::Load(channels[8])}};
+}
+
+template <typename MathT, typename TextureT>
+float LevelOfDetail(const TextureT* texture, const UvDerivatives& derivatives) {
+  // Longer side of the pixel footprint in texels
+  float width = static_cast<float>(texture->GetWidth());
+  float height = static_cast<float>(texture->GetHeight());
+  float du_dx = derivatives.dx.u * width;
+  float dv_dx = derivatives.dx.v * height;
+  float du_dy = derivatives.dy.u * width;
+  float dv_dy = derivatives.dy.v * height;
+  float rho2 = std::max(du_dx * du_dx + dv_dx * dv_dx,
+                        du_dy * du_dy + dv_dy * dv_dy);
+
+  return .5f * MathT::Log2(rho2);
+}
+
+float ShadowFactor(const Uniforms& uniforms, const Vec4f& shadow_position) {
+  // Nothing casts shadows behind the light
+  if (!uniforms.shadow_map || shadow_position.w <= 0.f) {
+    return 1.f;
+  }
+
+  int size = uniforms.shadow_map_size;
+  float inverse_w = 1.f / shadow_position.w;
+  float z = shadow_position.z * inverse_w;
+
+  // Clamped to the border texels, which the wide light frustum leaves empty
+  float max_coord = static_cast<float>(size - 1);
+  float x = std::clamp(shadow_position.x * inverse_w, 0.f, max_coord);
+  float y = std::clamp(shadow_position.y * inverse_w, 0.f, max_coord);
+  int x0 = std::min(static_cast<int>(x), size - 2);
+  int y0 = std::min(static_cast<int>(y), size - 2);
+  float fx = x - static_cast<float>(x0);
+  float fy = y - static_cast<float>(y0);
+
+  // Filter the depth tests of the 2x2 footprint, not the depths
+  const float* texel = uniforms.shadow_map + x0 + y0 * size;
+  float lit00 = z >= texel[0] ? 1.f : 0.f;
+  float lit10 = z >= texel[1] ? 1.f : 0.f;
+  float lit01 = z >= texel[size] ? 1.f : 0.f;
+  float lit11 = z >= texel[size + 1] ? 1.f : 0.f;
+
+  return (lit00 + (lit10 - lit00) * fx) * (1.f - fy) +
+         (lit01 + (lit11 - lit01) * fx) * fy;
+}
+
+simd::Float ShadowFactor(const Uniforms& uniforms,
+                         const simd::Vec4& shadow_position) {
+  simd::Float one = simd::Set(1.f);
+  if (!uniforms.shadow_map) {
+    return one;
+  }
+
+  // Lanes behind the light end up lit, keep w away from zero for them
+  simd::Float zero = simd::Set(0.f);
+  simd::Float behind = simd::Step(shadow_position.w, zero);
+  simd::Float inverse_w =
+      one / simd::Max(shadow_position.w, simd::Set(FLT_MIN));
+  simd::Float z = shadow_position.z * inverse_w;
+
+  // Clamping also brings unordered coordinates of inactive lanes to the
+  // border, every gathered index is valid
+  int size = uniforms.shadow_map_size;
+  simd::Float max_coord = simd::Set(static_cast<float>(size - 1));
+  simd::Float x =
+      simd::Max(simd::Min(shadow_position.x * inverse_w, max_coord), zero);
+  simd::Float y =
+      simd::Max(simd::Min(shadow_position.y * inverse_w, max_coord), zero);
+  simd::Float last = simd::Set(static_cast<float>(size - 2));
+  simd::Float x0 = simd::ToFloat(simd::Truncate(simd::Min(x, last)));
+  simd::Float y0 = simd::ToFloat(simd::Truncate(simd::Min(y, last)));
+  simd::Float fx = x - x0;
+  simd::Float fy = y - y0;
+
+  // Filter the depth tests of the 2x2 footprint, texel indices are exact in
+  // float for any practical map size
+  simd::Int index =
+      simd::Truncate(x0 + y0 * simd::Set(static_cast<float>(size)));
+  const float* map = uniforms.shadow_map;
+  simd::Float lit00 = simd::Step(simd::Gather(map, index), z);
+  simd::Float lit10 = simd::Step(simd::Gather(map + 1, index), z);
+  simd::Float lit01 = simd::Step(simd::Gather(map + size, index), z);
+  simd::Float lit11 = simd::Step(simd::Gather(map + size + 1, index), z);
+
+  simd::Float lit = (lit00 + (lit10 - lit00) * fx) * (one - fy) +
+                    (lit01 + (lit11 - lit01) * fx) * fy;
+  return lit + (one - lit) * behind;
+}
+
+Vec3f Reflect(const Vec3f& v, const Vec3f& normal) {
   return normal * 2.f * (normal * v) - v;
 }
 
+simd::Vec3 Reflect(const simd::Vec3& v, const simd::Vec3& normal) {
+  return normal * (simd::Set(2.f) * simd::Dot(normal, v)) - v;
+}
+
+template <typename MathT>
+Vec3f ShadePointLights(const Uniforms& uniforms, const LightList& lights,
+                       const Vec3f& position, const Vec3f& normal,
+                       const Vec3f& view_dir, const Vec3f& diffuse,
+                       const Vec3f& specular) {
+  Vec3f color{};
+  for (int i = 0; i < lights.count; ++i) {
+    const PointLight& light = uniforms.lights[lights.indices[i]];
+
+    Vec3f light_dir = light.position - position;
+    float distance2 = light_dir * light_dir;
+    float radius2 = light.radius * light.radius;
+    if (distance2 >= radius2) {
+      continue;
+    }
+
+    // Smooth window reaching zero at radius
+    float falloff = 1.f - distance2 / radius2;
+    float attenuation = falloff * falloff;
+
+    light_dir = MathT::Normalize(light_dir);
+    float diff = std::max(0.f, normal * light_dir);
+    Vec3f reflect = MathT::Normalize(Reflect(light_dir, normal));
+    float spec = MathT::Pow32(std::max(view_dir * reflect, 0.f));
+
+    Vec3f radiance = diffuse * diff + specular * spec;
+    color = color + Vec3f(radiance.x * light.color.x,
+                          radiance.y * light.color.y,
+                          radiance.z * light.color.z) *
+                        attenuation;
+  }
+
+  return color;
+}
+
+template <typename MathT>
+simd::Vec3 ShadePointLights(const Uniforms& uniforms, const LightList& lights,
+                            const simd::Vec3& position,
+                            const simd::Vec3& normal,
+                            const simd::Vec3& view_dir,
+                            const simd::Vec3& diffuse,
+                            const simd::Vec3& specular) {
+  simd::Vec3 color = simd::Set(0.f, 0.f, 0.f);
+  for (int i = 0; i < lights.count; ++i) {
+    const PointLight& light = uniforms.lights[lights.indices[i]];
+
+    simd::Vec3 light_dir =
+        simd::Set(light.position.x, light.position.y, light.position.z) -
+        position;
+
+    // Smooth window reaching zero at radius, lanes beyond it get nothing
+    simd::Float falloff = simd::Max(
+        simd::Set(0.f),
+        simd::Set(1.f) - simd::Dot(light_dir, light_dir) *
+                             simd::Set(1.f / (light.radius * light.radius)));
+    simd::Float attenuation = falloff * falloff;
+
+    light_dir = MathT::Normalize(light_dir);
+    simd::Float diff =
+        simd::Max(simd::Set(0.f), simd::Dot(normal, light_dir));
+    simd::Vec3 reflect = MathT::Normalize(Reflect(light_dir, normal));
+    simd::Float spec =
+        MathT::Pow32(simd::Max(simd::Dot(view_dir, reflect), simd::Set(0.f)));
+
+    simd::Vec3 radiance = diffuse * diff + specular * spec;
+    color = color + simd::Vec3{radiance.x * simd::Set(light.color.x),
+                               radiance.y * simd::Set(light.color.y),
+                               radiance.z * simd::Set(light.color.z)} *
+                        attenuation;
+  }
+
+  return color;
+}
+
 uint32_t GetColor(const Vec3f& color) {
-  uint32_t R = static_cast<uint32_t>(color.x);
-  uint32_t G = static_cast<uint32_t>(color.y);
-  uint32_t B = static_cast<uint32_t>(color.z);
+  uint32_t R = static_cast<uint32_t>(std::min(std::max(color.x, 0.f), 255.f));
+  uint32_t G = static_cast<uint32_t>(std::min(std::max(color.y, 0.f), 255.f));
+  uint32_t B = static_cast<uint32_t>(std::min(std::max(color.z, 0.f), 255.f));
 
-  return (255 << 24) | (B << 16) | (G << 8) | R;
+  return (255u << 24) | (B << 16) | (G << 8) | R;
 }
 
+simd::Int GetColor(const simd::Vec3& color) {
+  simd::Float low = simd::Set(0.f);
+  simd::Float high = simd::Set(255.f);
+  simd::Int R = simd::Truncate(simd::Min(simd::Max(color.x, low), high));
+  simd::Int G = simd::Truncate(simd::Min(simd::Max(color.y, low), high));
+  simd::Int B = simd::Truncate(simd::Min(simd::Max(color.z, low), high));
+
+  return simd::Set(static_cast<int>(0xff000000u)) | B << 16 | G << 8 | R;
+}
+
+template class Shader<ExactMath>;
+template class Shader<FastMath>;
+template class PhongShader<ExactMath>;
+template class PhongShader<FastMath>;
+template class NormalMappingShader<ExactMath>;
+template class NormalMappingShader<FastMath>;
+
 }  // namespace swr
@@ -10,14 +10,267 @@
  */
 #include "texture.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
 #include <cstdint>
+#include <cstring>
+#include <vector>
 
 namespace swr {
 
+namespace {
+
+// Texels of a block, row-major
+const int BLOCK_TEXELS = TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE;
+
+// Decoded blocks recently fetched by a thread, direct mapped on the block
+// address. Blocks are keyed by generation too, so that freed storage being
+// reused never hits
+const int BLOCK_CACHE_SIZE = 64;
+
+struct DecodedBlock {
+  const uint8_t* block;
+  uint32_t generation;
+  uint8_t texels[4 * BLOCK_TEXELS];
+};
+
+thread_local DecodedBlock block_cache[BLOCK_CACHE_SIZE];
+std::atomic<uint32_t> block_generation{1};
+
+int GetBlockSize(ETextureFormat format) {
+  return format == ETextureFormat::BC5_FORMAT ? 16 : 8;
+}
+
+uint16_t ToRgb565(const int* rgb) {
+  return static_cast<uint16_t>((rgb[0] * 31 + 127) / 255 << 11 |
+                               (rgb[1] * 63 + 127) / 255 << 5 |
+                               (rgb[2] * 31 + 127) / 255);
+}
+
+void FromRgb565(uint16_t color, int* rgb) {
+  int r = color >> 11;
+  int g = color >> 5 & 63;
+  int b = color & 31;
+  rgb[0] = r << 3 | r >> 2;
+  rgb[1] = g << 2 | g >> 4;
+  rgb[2] = b << 3 | b >> 2;
+}
+
+// Four color palette of a BC1 block
+void Bc1Palette(uint16_t color0, uint16_t color1, int palette[4][3]) {
+  FromRgb565(color0, palette[0]);
+  FromRgb565(color1, palette[1]);
+  for (int c = 0; c < 3; ++c) {
+    if (color0 > color1) {
+      palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+      palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    } else {
+      palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+      palette[3][c] = 0;
+    }
+  }
+}
+
+// Endpoints on the diagonal of the color bounding box that follows the
+// color spread, then the closest palette entry per texel
+void EncodeBc1(const uint8_t* texels, uint8_t* block) {
+  int min[3] = {255, 255, 255};
+  int max[3] = {0, 0, 0};
+  int mean[3] = {0, 0, 0};
+  for (int i = 0; i < BLOCK_TEXELS; ++i) {
+    for (int c = 0; c < 3; ++c) {
+      min[c] = std::min(min[c], static_cast<int>(texels[4 * i + c]));
+      max[c] = std::max(max[c], static_cast<int>(texels[4 * i + c]));
+      mean[c] += texels[4 * i + c];
+    }
+  }
+
+  // Channels decreasing while the widest one increases take the other
+  // diagonal
+  int widest = 0;
+  for (int c = 1; c < 3; ++c) {
+    if (max[c] - min[c] > max[widest] - min[widest]) {
+      widest = c;
+    }
+  }
+  for (int c = 0; c < 3; ++c) {
+    int covariance = 0;
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+      covariance += (texels[4 * i + widest] * BLOCK_TEXELS - mean[widest]) *
+                    (texels[4 * i + c] * BLOCK_TEXELS - mean[c]) / 256;
+    }
+    if (covariance < 0) {
+      std::swap(min[c], max[c]);
+    }
+  }
+
+  // Inset against the bias of extreme texels
+  for (int c = 0; c < 3; ++c) {
+    int inset = (max[c] - min[c]) / 16;
+    max[c] -= inset;
+    min[c] += inset;
+  }
+
+  uint16_t color0 = ToRgb565(max);
+  uint16_t color1 = ToRgb565(min);
+  if (color0 < color1) {
+    std::swap(color0, color1);
+  }
+  int palette[4][3];
+  Bc1Palette(color0, color1, palette);
+
+  uint32_t indices = 0;
+  for (int i = 0; i < BLOCK_TEXELS; ++i) {
+    int best = 0;
+    int best_distance = INT32_MAX;
+    // Four colors only, without the black of the three color mode
+    int entries = color0 > color1 ? 4 : 1;
+    for (int j = 0; j < entries; ++j) {
+      int distance = 0;
+      for (int c = 0; c < 3; ++c) {
+        int d = texels[4 * i + c] - palette[j][c];
+        distance += d * d;
+      }
+      if (distance < best_distance) {
+        best = j;
+        best_distance = distance;
+      }
+    }
+    indices |= static_cast<uint32_t>(best) << 2 * i;
+  }
+
+  std::memcpy(block, &color0, 2);
+  std::memcpy(block + 2, &color1, 2);
+  std::memcpy(block + 4, &indices, 4);
+}
+
+void DecodeBc1(const uint8_t* block, uint8_t* texels) {
+  uint16_t color0;
+  uint16_t color1;
+  uint32_t indices;
+  std::memcpy(&color0, block, 2);
+  std::memcpy(&color1, block + 2, 2);
+  std::memcpy(&indices, block + 4, 4);
+
+  int palette[4][3];
+  Bc1Palette(color0, color1, palette);
+  for (int i = 0; i < BLOCK_TEXELS; ++i) {
+    const int* color = palette[indices >> 2 * i & 3];
+    texels[4 * i + 0] = static_cast<uint8_t>(color[0]);
+    texels[4 * i + 1] = static_cast<uint8_t>(color[1]);
+    texels[4 * i + 2] = static_cast<uint8_t>(color[2]);
+    texels[4 * i + 3] = 255;
+  }
+}
+
+// Eight level palette of a BC4 block
+void Bc4Palette(int value0, int value1, int* palette) {
+  palette[0] = value0;
+  palette[1] = value1;
+  if (value0 > value1) {
+    for (int i = 2; i < 8; ++i) {
+      palette[i] = ((8 - i) * value0 + (i - 1) * value1) / 7;
+    }
+  } else {
+    for (int i = 2; i < 6; ++i) {
+      palette[i] = ((6 - i) * value0 + (i - 1) * value1) / 5;
+    }
+    palette[6] = 0;
+    palette[7] = 255;
+  }
+}
+
+// Channel channel of the texels, always in the eight level mode
+void EncodeBc4(const uint8_t* texels, int channel, uint8_t* block) {
+  int min = 255;
+  int max = 0;
+  for (int i = 0; i < BLOCK_TEXELS; ++i) {
+    min = std::min(min, static_cast<int>(texels[4 * i + channel]));
+    max = std::max(max, static_cast<int>(texels[4 * i + channel]));
+  }
+
+  int palette[8];
+  Bc4Palette(max, min, palette);
+
+  uint64_t indices = 0;
+  for (int i = 0; i < BLOCK_TEXELS; ++i) {
+    int best = 0;
+    for (int j = 1; j < 8; ++j) {
+      if (std::abs(texels[4 * i + channel] - palette[j]) <
+          std::abs(texels[4 * i + channel] - palette[best])) {
+        best = j;
+      }
+    }
+    indices |= static_cast<uint64_t>(best) << 3 * i;
+  }
+
+  block[0] = static_cast<uint8_t>(max);
+  block[1] = static_cast<uint8_t>(min);
+  for (int i = 0; i < 6; ++i) {
+    block[2 + i] = static_cast<uint8_t>(indices >> 8 * i);
+  }
+}
+
+void DecodeBc4(const uint8_t* block, int channel, uint8_t* texels) {
+  int palette[8];
+  Bc4Palette(block[0], block[1], palette);
+
+  uint64_t indices = 0;
+  for (int i = 0; i < 6; ++i) {
+    indices |= static_cast<uint64_t>(block[2 + i]) << 8 * i;
+  }
+  for (int i = 0; i < BLOCK_TEXELS; ++i) {
+    texels[4 * i + channel] =
+        static_cast<uint8_t>(palette[indices >> 3 * i & 7]);
+  }
+}
+
+// Unit vector of the nonzero v, rounded to the nearest NormalTexel
+NormalTexel EncodeNormal(Vec3f v) {
+  Vec3f unit = v.Normalize();
+  auto quantize = [](float f, int scale) {
+    return static_cast<uint32_t>(
+        std::round((std::clamp(f, -1.f, 1.f) + 1.f) * scale));
+  };
+  return NormalTexel{quantize(unit.x, NORMAL_XY_SCALE) |
+                     quantize(unit.y, NORMAL_XY_SCALE) << 11 |
+                     quantize(unit.z, NORMAL_Z_SCALE) << 22};
+}
+
+}  // namespace
+
 Texture::Texture(int width, int height, uint8_t* data)
-    : width_{width}, height_{height}, data_{data} {}
+    : width_{width}, height_{height}, data_{data} {
+  levels_.push_back(
+      MipLevel{width, height, data, ETextureLayout::LINEAR_LAYOUT,
+               ETextureFormat::RGBA8_FORMAT, 0, nullptr, 0});
+}
+
+Texture::Texture(VirtualTexture* virtual_texture)
+    : width_{virtual_texture->GetWidth()},
+      height_{virtual_texture->GetHeight()},
+      data_{nullptr},
+      virtual_texture_{virtual_texture} {
+  for (int i = 0; i < virtual_texture->GetLevelsCount(); ++i) {
+    levels_.push_back(MipLevel{virtual_texture->GetLevelWidth(i),
+                               virtual_texture->GetLevelHeight(i), nullptr,
+                               ETextureLayout::LINEAR_LAYOUT,
+                               ETextureFormat::RGBA8_FORMAT, 0,
+                               virtual_texture, i});
+  }
+}
 
-Texture::~Texture() { delete[] data_; }
+Texture::~Texture() {
+  // Cached blocks of the levels must not outlive them
+  ++block_generation;
+  for (size_t i = 1; i < levels_.size(); ++i) {
+    delete[] levels_[i].data;
+  }
+  delete[] data_;
+  delete virtual_texture_;
+}
 
 int Texture::GetWidth() const { return width_; }
 
@@ -25,4 +278,343 @@ int Texture::GetHeight() const { return height_; }
 
 uint8_t* Texture::GetData() const { return data_; }
 
+void Texture::GenerateMipmaps() {
+  if (virtual_texture_) {
+    return;
+  }
+
+  // Built in linear layout, then brought to the layout of the image
+  ETextureLayout layout = GetLayout();
+  SetLayout(ETextureLayout::LINEAR_LAYOUT);
+
+  while (levels_.back().width > 1 || levels_.back().height > 1) {
+    const MipLevel& source = levels_.back();
+    MipLevel level{std::max(1, source.width / 2),
+                   std::max(1, source.height / 2), nullptr,
+                   ETextureLayout::LINEAR_LAYOUT,
+                   ETextureFormat::RGBA8_FORMAT, 0, nullptr, 0};
+    level.data = new uint8_t[4 * level.width * level.height];
+
+    // Average 2x2 texels, odd edges repeat their last texel
+    for (int y = 0; y < level.height; ++y) {
+      int y0 = std::min(2 * y, source.height - 1);
+      int y1 = std::min(2 * y + 1, source.height - 1);
+      for (int x = 0; x < level.width; ++x) {
+        int x0 = std::min(2 * x, source.width - 1);
+        int x1 = std::min(2 * x + 1, source.width - 1);
+        for (int c = 0; c < 4; ++c) {
+          int sum = source.data[4 * (y0 * source.width + x0) + c] +
+                    source.data[4 * (y0 * source.width + x1) + c] +
+                    source.data[4 * (y1 * source.width + x0) + c] +
+                    source.data[4 * (y1 * source.width + x1) + c];
+          level.data[4 * (y * level.width + x) + c] =
+              static_cast<uint8_t>((sum + 2) / 4);
+        }
+      }
+    }
+
+    levels_.push_back(level);
+  }
+
+  SetLayout(layout);
+}
+
+int Texture::GetLevelsCount() const {
+  return static_cast<int>(levels_.size());
+}
+
+const MipLevel& Texture::GetLevel(int level) const { return levels_[level]; }
+
+void Texture::SetLayout(ETextureLayout layout) {
+  for (MipLevel& level : levels_) {
+    if (level.layout == layout || !level.IsAddressable()) {
+      continue;
+    }
+
+    MipLevel converted = level;
+    converted.layout = layout;
+    int size = 4 * level.width * level.height;
+    if (layout == ETextureLayout::TILED_LAYOUT) {
+      converted.tiles_per_row =
+          (level.width + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+      int tile_rows =
+          (level.height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+      size = 4 * converted.tiles_per_row * tile_rows * TEXTURE_TILE_SIZE *
+             TEXTURE_TILE_SIZE;
+    }
+    converted.data = new uint8_t[size]();
+
+    for (int y = 0; y < level.height; ++y) {
+      for (int x = 0; x < level.width; ++x) {
+        std::memcpy(converted.Texel(x, y), level.Texel(x, y), 4);
+      }
+    }
+
+    delete[] level.data;
+    level = converted;
+  }
+
+  data_ = levels_[0].data;
+}
+
+ETextureLayout Texture::GetLayout() const { return levels_[0].layout; }
+
+const uint8_t* MipLevel::FetchCompressed(int x, int y) const {
+  const uint8_t* block =
+      data + GetBlockSize(format) * ((x >> TEXTURE_TILE_BITS) +
+                                     (y >> TEXTURE_TILE_BITS) * tiles_per_row);
+  uint32_t generation = block_generation.load(std::memory_order_relaxed);
+
+  DecodedBlock& entry =
+      block_cache[(reinterpret_cast<uintptr_t>(block) >> 3) %
+                  BLOCK_CACHE_SIZE];
+  if (entry.block != block || entry.generation != generation) {
+    uint8_t* texels = entry.texels;
+    switch (format) {
+      case ETextureFormat::BC1_FORMAT:
+        DecodeBc1(block, texels);
+        break;
+      case ETextureFormat::BC4_FORMAT:
+        // Gray
+        DecodeBc4(block, 0, texels);
+        for (int i = 0; i < BLOCK_TEXELS; ++i) {
+          texels[4 * i + 1] = texels[4 * i + 2] = texels[4 * i];
+          texels[4 * i + 3] = 255;
+        }
+        break;
+      case ETextureFormat::BC5_FORMAT:
+        DecodeBc4(block, 0, texels);
+        DecodeBc4(block + 8, 1, texels);
+        // Unit vector, z >= 0 from x and y
+        for (int i = 0; i < BLOCK_TEXELS; ++i) {
+          float nx = texels[4 * i + 0] / 127.5f - 1.f;
+          float ny = texels[4 * i + 1] / 127.5f - 1.f;
+          float nz = std::sqrt(std::max(0.f, 1.f - nx * nx - ny * ny));
+          texels[4 * i + 2] = static_cast<uint8_t>(nz * 127.5f + 128.f);
+          texels[4 * i + 3] = 255;
+        }
+        break;
+      default:
+        break;
+    }
+    entry.block = block;
+    entry.generation = generation;
+  }
+
+  int texel = (x & (TEXTURE_TILE_SIZE - 1)) +
+              ((y & (TEXTURE_TILE_SIZE - 1)) << TEXTURE_TILE_BITS);
+  return entry.texels + 4 * texel;
+}
+
+void Texture::Compress(ETextureFormat format) {
+  if (format == ETextureFormat::RGBA8_FORMAT || virtual_texture_) {
+    return;
+  }
+
+  for (MipLevel& level : levels_) {
+    if (level.format != ETextureFormat::RGBA8_FORMAT) {
+      continue;
+    }
+
+    MipLevel compressed = level;
+    compressed.layout = ETextureLayout::TILED_LAYOUT;
+    compressed.format = format;
+    compressed.tiles_per_row =
+        (level.width + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+    int tile_rows = (level.height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+    int block_size = GetBlockSize(format);
+    compressed.data =
+        new uint8_t[block_size * compressed.tiles_per_row * tile_rows];
+
+    uint8_t texels[4 * BLOCK_TEXELS];
+    for (int tile_y = 0; tile_y < tile_rows; ++tile_y) {
+      for (int tile_x = 0; tile_x < compressed.tiles_per_row; ++tile_x) {
+        // Texels past the edges repeat the last ones
+        for (int i = 0; i < BLOCK_TEXELS; ++i) {
+          int x = std::min(tile_x * TEXTURE_TILE_SIZE + i % TEXTURE_TILE_SIZE,
+                           level.width - 1);
+          int y = std::min(tile_y * TEXTURE_TILE_SIZE + i / TEXTURE_TILE_SIZE,
+                           level.height - 1);
+          std::memcpy(texels + 4 * i, level.Texel(x, y), 4);
+        }
+
+        int tile = tile_x + tile_y * compressed.tiles_per_row;
+        uint8_t* block = compressed.data + block_size * tile;
+        switch (format) {
+          case ETextureFormat::BC1_FORMAT:
+            EncodeBc1(texels, block);
+            break;
+          case ETextureFormat::BC4_FORMAT:
+            EncodeBc4(texels, 0, block);
+            break;
+          case ETextureFormat::BC5_FORMAT:
+            EncodeBc4(texels, 0, block);
+            EncodeBc4(texels, 1, block + 8);
+            break;
+          default:
+            break;
+        }
+      }
+    }
+
+    delete[] level.data;
+    level = compressed;
+  }
+
+  data_ = levels_[0].data;
+  ++block_generation;
+}
+
+size_t Texture::GetMemorySize() const {
+  if (virtual_texture_) {
+    return virtual_texture_->GetMemorySize();
+  }
+
+  size_t size = 0;
+  for (const MipLevel& level : levels_) {
+    int tile_rows = (level.height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+    if (level.format != ETextureFormat::RGBA8_FORMAT) {
+      size += static_cast<size_t>(GetBlockSize(level.format)) *
+              level.tiles_per_row * tile_rows;
+    } else if (level.layout == ETextureLayout::TILED_LAYOUT) {
+      size += static_cast<size_t>(4 * TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE) *
+              level.tiles_per_row * tile_rows;
+    } else {
+      size += static_cast<size_t>(4) * level.width * level.height;
+    }
+  }
+  return size;
+}
+
+VirtualTexture* Texture::GetVirtualTexture() const {
+  return virtual_texture_;
+}
+
+MaterialTexture::MaterialTexture(const Texture* diffuse,
+                                 const Texture* normal_tangent,
+                                 const Texture* specular) {
+  MaterialLevel base{diffuse->GetWidth(), diffuse->GetHeight(), nullptr};
+  base.data = new MaterialTexel[base.width * base.height]();
+
+  // Nearest texel of a map at the center of a texel of the base level
+  auto fetch = [&](const Texture* texture, int x, int y) {
+    const MipLevel& level = texture->GetLevel(0);
+    return level.Fetch(x * level.width / base.width,
+                       y * level.height / base.height);
+  };
+
+  for (int y = 0; y < base.height; ++y) {
+    for (int x = 0; x < base.width; ++x) {
+      MaterialTexel& texel = base.data[x + y * base.width];
+      std::memcpy(texel.diffuse, fetch(diffuse, x, y), 3);
+      std::memcpy(texel.normal, fetch(normal_tangent, x, y), 2);
+      texel.specular = fetch(specular, x, y)[0];
+    }
+  }
+  levels_.push_back(base);
+
+  // Same box filter as Texture::GenerateMipmaps
+  while (levels_.back().width > 1 || levels_.back().height > 1) {
+    const MaterialLevel& source = levels_.back();
+    MaterialLevel level{std::max(1, source.width / 2),
+                        std::max(1, source.height / 2), nullptr};
+    level.data = new MaterialTexel[level.width * level.height]();
+
+    for (int y = 0; y < level.height; ++y) {
+      int y0 = std::min(2 * y, source.height - 1);
+      int y1 = std::min(2 * y + 1, source.height - 1);
+      for (int x = 0; x < level.width; ++x) {
+        int x0 = std::min(2 * x, source.width - 1);
+        int x1 = std::min(2 * x + 1, source.width - 1);
+        // Averaged as bytes, padding included
+        auto bytes = [&](int column, int row) {
+          return reinterpret_cast<const uint8_t*>(&source.Texel(column, row));
+        };
+        const uint8_t* texels[4] = {bytes(x0, y0), bytes(x1, y0),
+                                    bytes(x0, y1), bytes(x1, y1)};
+        uint8_t* texel =
+            reinterpret_cast<uint8_t*>(&level.data[x + y * level.width]);
+        for (int c = 0; c < static_cast<int>(sizeof(MaterialTexel)); ++c) {
+          int sum = texels[0][c] + texels[1][c] + texels[2][c] + texels[3][c];
+          texel[c] = static_cast<uint8_t>((sum + 2) / 4);
+        }
+      }
+    }
+
+    levels_.push_back(level);
+  }
+}
+
+MaterialTexture::~MaterialTexture() {
+  for (MaterialLevel& level : levels_) {
+    delete[] level.data;
+  }
+}
+
+int MaterialTexture::GetWidth() const { return levels_[0].width; }
+
+int MaterialTexture::GetHeight() const { return levels_[0].height; }
+
+int MaterialTexture::GetLevelsCount() const {
+  return static_cast<int>(levels_.size());
+}
+
+const MaterialLevel& MaterialTexture::GetLevel(int level) const {
+  return levels_[level];
+}
+
+size_t MaterialTexture::GetMemorySize() const {
+  size_t size = 0;
+  for (const MaterialLevel& level : levels_) {
+    size += sizeof(MaterialTexel) * level.width * level.height;
+  }
+  return size;
+}
+
+NormalMap::NormalMap(const Texture* texture) {
+  for (int i = 0; i < texture->GetLevelsCount(); ++i) {
+    const MipLevel& source = texture->GetLevel(i);
+    NormalLevel level{source.width, source.height, nullptr};
+    level.data = new NormalTexel[level.width * level.height];
+
+    for (int y = 0; y < level.height; ++y) {
+      for (int x = 0; x < level.width; ++x) {
+        const uint8_t* texel = source.Fetch(x, y);
+        Vec3f normal(static_cast<float>(texel[0]),
+                     static_cast<float>(texel[1]),
+                     static_cast<float>(texel[2]));
+        level.data[x + y * level.width] = EncodeNormal(normal * 2.f - 255.f);
+      }
+    }
+
+    levels_.push_back(level);
+  }
+}
+
+NormalMap::~NormalMap() {
+  for (NormalLevel& level : levels_) {
+    delete[] level.data;
+  }
+}
+
+int NormalMap::GetWidth() const { return levels_[0].width; }
+
+int NormalMap::GetHeight() const { return levels_[0].height; }
+
+int NormalMap::GetLevelsCount() const {
+  return static_cast<int>(levels_.size());
+}
+
+const NormalLevel& NormalMap::GetLevel(int level) const {
+  return levels_[level];
+}
+
+size_t NormalMap::GetMemorySize() const {
+  size_t size = 0;
+  for (const NormalLevel& level : levels_) {
+    size += sizeof(NormalTexel) * level.width * level.height;
+  }
+  return size;
+}
+
 }  // namespace swr
@@ -0,0 +1,103 @@
+/**
+ * @file thread_pool.cc
+ * @author Mao Zhang (mao.zhang233@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "thread_pool.h"
+
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+namespace swr {
+
+ThreadPool::ThreadPool(int thread_count) {
+  std::clog << "----- ThreadPool::ThreadPool -----" << std::endl;
+
+  // thread 0 is the caller of ParallelFor
+  for (int i = 1; i < thread_count; ++i) {
+    workers_.emplace_back(&ThreadPool::WorkerLoop, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  std::clog << "----- ThreadPool::~ThreadPool -----" << std::endl;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+int ThreadPool::GetThreadCount() const {
+  return static_cast<int>(workers_.size()) + 1;
+}
+
+void ThreadPool::ParallelFor(int count,
+                             const std::function<void(int, int)>& task) {
+  if (workers_.empty() || count <= 1) {
+    for (int i = 0; i < count; ++i) {
+      task(i, 0);
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    task_ = &task;
+    count_ = count;
+    next_ = 0;
+    busy_ = static_cast<int>(workers_.size());
+    ++generation_;
+  }
+  wake_.notify_all();
+
+  RunTasks(0);
+
+  // Wait for workers to drain the batch before task goes out of scope
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this] { return busy_ == 0; });
+  task_ = nullptr;
+}
+
+void ThreadPool::WorkerLoop(int thread) {
+  uint64_t generation = 0;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_.wait(lock,
+                 [&] { return stop_ || generation_ != generation; });
+      if (stop_) {
+        return;
+      }
+      generation = generation_;
+    }
+
+    RunTasks(thread);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--busy_ == 0) {
+      done_.notify_one();
+    }
+  }
+}
+
+void ThreadPool::RunTasks(int thread) {
+  for (int i = next_.fetch_add(1); i < count_; i = next_.fetch_add(1)) {
+    (*task_)(i, thread);
+  }
+}
+
+}  // namespace swr
@@ -0,0 +1,384 @@
+/**
+ * @file virtual_texture.cc
+ * @author Mao Zhang (mao.zhang233@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "virtual_texture.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <system_error>
+
+#include "texture.h"
+
+namespace swr {
+
+namespace {
+
+const char PAGE_FILE_MAGIC[4] = {'S', 'W', 'R', 'P'};
+const int32_t PAGE_FILE_VERSION = 2;
+
+// Pages follow the header, a level is as many pages as cover it. The size
+// and modification time of the source image tell stale page files
+struct PageFileHeader {
+  char magic[4];
+  int32_t version;
+  int32_t width;
+  int32_t height;
+  int32_t levels_count;
+  int32_t page_size;
+  int64_t source_size;
+  int64_t source_time;
+};
+
+int GetPagesCount(int texels) {
+  return (texels + VIRTUAL_PAGE_SIZE - 1) / VIRTUAL_PAGE_SIZE;
+}
+
+// Pages of all levels, same halving as Texture::GenerateMipmaps
+int64_t GetPagesCount(const PageFileHeader& header) {
+  int64_t pages_count = 0;
+  int width = header.width;
+  int height = header.height;
+  for (int i = 0; i < header.levels_count; ++i) {
+    pages_count += static_cast<int64_t>(GetPagesCount(width)) *
+                   GetPagesCount(height);
+    width = std::max(1, width / 2);
+    height = std::max(1, height / 2);
+  }
+  return pages_count;
+}
+
+// Size and modification time of source, false if it cannot be read
+bool GetSourceStamp(const std::string& source, int64_t& size,
+                    int64_t& time) {
+  std::error_code error;
+  std::uintmax_t file_size = std::filesystem::file_size(source, error);
+  if (error) {
+    return false;
+  }
+  std::filesystem::file_time_type write_time =
+      std::filesystem::last_write_time(source, error);
+  if (error) {
+    return false;
+  }
+
+  size = static_cast<int64_t>(file_size);
+  time = static_cast<int64_t>(write_time.time_since_epoch().count());
+  return true;
+}
+
+// Header of a page file of this version whose pages are all there, the
+// stream is left after the header
+bool ReadHeader(std::ifstream& file, PageFileHeader& header) {
+  file.seekg(0, std::ifstream::end);
+  int64_t file_size = static_cast<int64_t>(file.tellg());
+  file.seekg(0, std::ifstream::beg);
+
+  file.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if (file.fail() ||
+      std::memcmp(header.magic, PAGE_FILE_MAGIC, sizeof(header.magic)) ||
+      header.version != PAGE_FILE_VERSION ||
+      header.page_size != VIRTUAL_PAGE_SIZE || header.width < 1 ||
+      header.height < 1 || header.levels_count < 1) {
+    return false;
+  }
+  return file_size == static_cast<int64_t>(sizeof(header)) +
+                          GetPagesCount(header) * VIRTUAL_PAGE_BYTES;
+}
+
+// FNV-1a, stable across runs and platforms unlike std::hash
+uint64_t HashString(const std::string& string) {
+  uint64_t hash = 14695981039346656037ull;
+  for (char c : string) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+}  // namespace
+
+VirtualTexture::VirtualTexture(const std::string& filename, int cache_pages) {
+  std::clog << "----- VirtualTexture::VirtualTexture -----" << std::endl;
+
+  file_.open(filename, std::ifstream::in | std::ifstream::binary);
+  if (file_.fail()) {
+    throw std::runtime_error("----- Error::OPEN_FILE_FAILURE -----");
+  }
+
+  PageFileHeader header;
+  if (!ReadHeader(file_, header)) {
+    throw std::runtime_error("----- Error::LOAD_TEXTURE_FAILURE -----");
+  }
+
+  // Same halving as Texture::GenerateMipmaps
+  int width = header.width;
+  int height = header.height;
+  int pages_count = 0;
+  for (int i = 0; i < header.levels_count; ++i) {
+    PageLevel level{width, height, GetPagesCount(width), pages_count};
+    pages_count += level.pages_per_row * GetPagesCount(height);
+    levels_.push_back(level);
+    width = std::max(1, width / 2);
+    height = std::max(1, height / 2);
+  }
+
+  page_table_.assign(pages_count, -1);
+  page_frames_ = new std::atomic<uint32_t>[pages_count]();
+
+  // Levels of a single page are pinned, they are the last pages of the file
+  int pinned_first = pages_count;
+  for (int i = header.levels_count - 1; i >= 0; --i) {
+    if (levels_[i].width > VIRTUAL_PAGE_SIZE ||
+        levels_[i].height > VIRTUAL_PAGE_SIZE) {
+      break;
+    }
+    pinned_first = levels_[i].first_page;
+  }
+  pinned_pages_ = pages_count - pinned_first;
+
+  cache_pages_ = std::max(cache_pages, pinned_pages_ + 1);
+  cache_ = new uint8_t[static_cast<size_t>(cache_pages_) * VIRTUAL_PAGE_BYTES];
+  slot_pages_.assign(cache_pages_, -1);
+
+  for (int i = 0; i < pinned_pages_; ++i) {
+    LoadPage(pinned_first + i, i);
+  }
+}
+
+VirtualTexture::~VirtualTexture() {
+  delete[] cache_;
+  delete[] page_frames_;
+}
+
+std::string VirtualTexture::GetPageFilename(const std::string& source,
+                                            const std::string& directory) {
+  // Images of the same name in different directories get their own files
+  std::error_code error;
+  std::filesystem::path path = std::filesystem::absolute(source, error);
+  if (error) {
+    path = source;
+  }
+  char hash[17];
+  std::snprintf(hash, sizeof(hash), "%016llx",
+                static_cast<unsigned long long>(
+                    HashString(path.lexically_normal().string())));
+
+  return (std::filesystem::path(directory) /
+          (path.filename().string() + "." + hash + ".pages"))
+      .string();
+}
+
+bool VirtualTexture::IsPageFileCurrent(const std::string& filename,
+                                       const std::string& source) {
+  int64_t source_size;
+  int64_t source_time;
+  if (!GetSourceStamp(source, source_size, source_time)) {
+    return false;
+  }
+
+  std::ifstream file(filename, std::ifstream::in | std::ifstream::binary);
+  PageFileHeader header;
+  return !file.fail() && ReadHeader(file, header) &&
+         header.source_size == source_size &&
+         header.source_time == source_time;
+}
+
+void VirtualTexture::WritePageFile(const Texture* texture,
+                                   const std::string& source,
+                                   const std::string& filename) {
+  std::clog << "----- VirtualTexture::WritePageFile -----" << std::endl;
+
+  PageFileHeader header{{},
+                        PAGE_FILE_VERSION,
+                        texture->GetWidth(),
+                        texture->GetHeight(),
+                        texture->GetLevelsCount(),
+                        VIRTUAL_PAGE_SIZE,
+                        0,
+                        0};
+  std::memcpy(header.magic, PAGE_FILE_MAGIC, sizeof(header.magic));
+  if (!GetSourceStamp(source, header.source_size, header.source_time)) {
+    throw std::runtime_error("----- Error::OPEN_FILE_FAILURE -----");
+  }
+
+  // Same directory as filename so that the rename stays on one file system,
+  // named per writer so that concurrent bakes do not share it
+  std::error_code error;
+  std::filesystem::path directory =
+      std::filesystem::path(filename).parent_path();
+  if (!directory.empty()) {
+    std::filesystem::create_directories(directory, error);
+  }
+  std::string temporary_filename =
+      filename + "." + std::to_string(std::random_device{}()) + ".tmp";
+
+  std::ofstream out_file_stream(temporary_filename,
+                                std::ofstream::out | std::ofstream::binary |
+                                    std::ofstream::trunc);
+  if (out_file_stream.fail()) {
+    throw std::runtime_error("----- Error::OPEN_FILE_FAILURE -----");
+  }
+
+  out_file_stream.write(reinterpret_cast<const char*>(&header),
+                        sizeof(header));
+
+  std::vector<char> page(VIRTUAL_PAGE_BYTES);
+  for (int i = 0; i < texture->GetLevelsCount(); ++i) {
+    const MipLevel& level = texture->GetLevel(i);
+    for (int page_y = 0; page_y < GetPagesCount(level.height); ++page_y) {
+      for (int page_x = 0; page_x < GetPagesCount(level.width); ++page_x) {
+        for (int y = 0; y < VIRTUAL_PAGE_SIZE; ++y) {
+          for (int x = 0; x < VIRTUAL_PAGE_SIZE; ++x) {
+            int texel_x = std::min(page_x * VIRTUAL_PAGE_SIZE + x,
+                                   level.width - 1);
+            int texel_y = std::min(page_y * VIRTUAL_PAGE_SIZE + y,
+                                   level.height - 1);
+            std::memcpy(&page[4 * (x + y * VIRTUAL_PAGE_SIZE)],
+                        level.Fetch(texel_x, texel_y), 4);
+          }
+        }
+        out_file_stream.write(page.data(), VIRTUAL_PAGE_BYTES);
+      }
+    }
+  }
+
+  out_file_stream.close();
+  if (out_file_stream.fail()) {
+    std::filesystem::remove(temporary_filename, error);
+    throw std::runtime_error("----- Error::WRITE_FILE_FAILURE -----");
+  }
+  std::filesystem::rename(temporary_filename, filename, error);
+  if (error) {
+    std::filesystem::remove(temporary_filename, error);
+    throw std::runtime_error("----- Error::WRITE_FILE_FAILURE -----");
+  }
+}
+
+int VirtualTexture::GetWidth() const { return levels_[0].width; }
+
+int VirtualTexture::GetHeight() const { return levels_[0].height; }
+
+int VirtualTexture::GetLevelsCount() const {
+  return static_cast<int>(levels_.size());
+}
+
+int VirtualTexture::GetLevelWidth(int level) const {
+  return levels_[level].width;
+}
+
+int VirtualTexture::GetLevelHeight(int level) const {
+  return levels_[level].height;
+}
+
+const uint8_t* VirtualTexture::Fetch(int level, int x, int y) const {
+  while (true) {
+    const PageLevel& page_level = levels_[level];
+    int page = page_level.first_page + (x >> VIRTUAL_PAGE_BITS) +
+               (y >> VIRTUAL_PAGE_BITS) * page_level.pages_per_row;
+
+    // Stamped once per frame, the stamp is both the request and the recency
+    // of the page
+    if (page_frames_[page].load(std::memory_order_relaxed) != frame_) {
+      page_frames_[page].store(frame_, std::memory_order_relaxed);
+    }
+
+    int slot = page_table_[page];
+    if (slot >= 0) {
+      int texel = (x & (VIRTUAL_PAGE_SIZE - 1)) +
+                  ((y & (VIRTUAL_PAGE_SIZE - 1)) << VIRTUAL_PAGE_BITS);
+      return cache_ + static_cast<size_t>(slot) * VIRTUAL_PAGE_BYTES +
+             4 * texel;
+    }
+
+    // Same texel one level coarser, pinned levels end the walk
+    ++level;
+    x = std::min(x >> 1, levels_[level].width - 1);
+    y = std::min(y >> 1, levels_[level].height - 1);
+  }
+}
+
+void VirtualTexture::Update(int max_pages) {
+  // Requested this frame and missing, coarser levels have higher indices and
+  // cover more of the screen per page
+  std::vector<int> requests;
+  for (int page = 0; page < static_cast<int>(page_table_.size()); ++page) {
+    if (page_table_[page] < 0 &&
+        page_frames_[page].load(std::memory_order_relaxed) == frame_) {
+      requests.push_back(page);
+    }
+  }
+  std::sort(requests.begin(), requests.end(), std::greater<int>());
+  if (static_cast<int>(requests.size()) > max_pages) {
+    requests.resize(max_pages);
+  }
+
+  for (int page : requests) {
+    // A free slot, else the least recently used page not fetched this frame
+    int victim = -1;
+    uint32_t victim_frame = frame_;
+    for (int slot = pinned_pages_; slot < cache_pages_; ++slot) {
+      if (slot_pages_[slot] < 0) {
+        victim = slot;
+        break;
+      }
+      uint32_t slot_frame =
+          page_frames_[slot_pages_[slot]].load(std::memory_order_relaxed);
+      if (slot_frame < victim_frame) {
+        victim = slot;
+        victim_frame = slot_frame;
+      }
+    }
+    if (victim < 0) {
+      // Every cached page is in use, the rest waits for the next frames
+      break;
+    }
+
+    if (slot_pages_[victim] >= 0) {
+      page_table_[slot_pages_[victim]] = -1;
+    }
+    LoadPage(page, victim);
+  }
+
+  ++frame_;
+}
+
+int VirtualTexture::GetResidentPagesCount() const {
+  return static_cast<int>(
+      std::count_if(slot_pages_.begin(), slot_pages_.end(),
+                    [](int page) { return page >= 0; }));
+}
+
+size_t VirtualTexture::GetMemorySize() const {
+  return static_cast<size_t>(cache_pages_) * VIRTUAL_PAGE_BYTES +
+         page_table_.size() * (sizeof(int) + sizeof(std::atomic<uint32_t>)) +
+         slot_pages_.size() * sizeof(int);
+}
+
+void VirtualTexture::LoadPage(int page, int slot) {
+  file_.seekg(static_cast<std::streamoff>(sizeof(PageFileHeader)) +
+              static_cast<std::streamoff>(page) * VIRTUAL_PAGE_BYTES);
+  file_.read(reinterpret_cast<char*>(cache_) +
+                 static_cast<size_t>(slot) * VIRTUAL_PAGE_BYTES,
+             VIRTUAL_PAGE_BYTES);
+  if (file_.fail()) {
+    throw std::runtime_error("----- Error::LOAD_TEXTURE_FAILURE -----");
+  }
+
+  page_table_[page] = slot;
+  slot_pages_[slot] = page;
+}
+
+}  // namespace swr
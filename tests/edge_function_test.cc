@@ -0,0 +1,137 @@
+/**
+ * @file edge_function_test.cc
+ * @author Mao Zhang (mao.zhang233@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <cstdint>
+#include <cstdio>
+
+#include "edge_function.h"
+#include "simd.h"
+#include "utils.h"
+
+namespace {
+
+using swr::EdgeFunction;
+using swr::Vec3f;
+
+// Pixels around each probe point compared between the two paths
+const int WINDOW_SIZE = 64;
+
+int failures = 0;
+
+// Exact 64-bit sign against the SIMD sign of edge at every lane of the
+// blocks of a window, returns the mismatches
+int CompareEdge(const EdgeFunction& edge, int center_x, int center_y) {
+  int mismatches = 0;
+  swr::simd::Int offsets = swr::EdgeLaneOffsets(edge);
+  int x0 = center_x - WINDOW_SIZE / 2;
+  int y0 = center_y - WINDOW_SIZE / 2;
+  x0 -= ((x0 % swr::simd::BLOCK_WIDTH) + swr::simd::BLOCK_WIDTH) %
+        swr::simd::BLOCK_WIDTH;
+  y0 -= ((y0 % swr::simd::BLOCK_HEIGHT) + swr::simd::BLOCK_HEIGHT) %
+        swr::simd::BLOCK_HEIGHT;
+
+  for (int y = y0; y < y0 + WINDOW_SIZE; y += swr::simd::BLOCK_HEIGHT) {
+    for (int x = x0; x < x0 + WINDOW_SIZE; x += swr::simd::BLOCK_WIDTH) {
+      int lanes[swr::simd::LANES];
+      swr::simd::Store(lanes, swr::EvaluateEdgeBlock(edge, offsets, x, y));
+      for (int lane = 0; lane < swr::simd::LANES; ++lane) {
+        int lane_x = x + lane % swr::simd::BLOCK_WIDTH;
+        int lane_y = y + lane / swr::simd::BLOCK_WIDTH;
+        bool exact = swr::EvaluateEdge(edge, lane_x, lane_y) >= 0;
+        if ((lanes[lane] >= 0) != exact) {
+          ++mismatches;
+        }
+      }
+    }
+  }
+  return mismatches;
+}
+
+// Coverage of the SIMD rasterizer against the scalar one near the vertices
+// and the edges of a triangle. Edges out of SIMD range must be rejected, the
+// renderer rasterizes their triangles with the scalar path
+void CheckTriangle(const char* name, const Vec3f (&v)[3],
+                   bool expect_simd) {
+  EdgeFunction edges[3];
+  int64_t area = 0;
+  if (!swr::SetupEdgeFunctions(v, edges, area) || area <= 0) {
+    std::printf("%s: setup failed\n", name);
+    ++failures;
+    return;
+  }
+
+  bool simd = true;
+  for (const EdgeFunction& edge : edges) {
+    simd = simd && swr::IsSimdEdge(edge);
+  }
+  if (expect_simd && !simd) {
+    std::printf("%s: expected the SIMD path\n", name);
+    ++failures;
+  }
+
+  int mismatches = 0;
+  for (int i = 0; i < 3; ++i) {
+    if (!swr::IsSimdEdge(edges[i])) {
+      continue;
+    }
+
+    // Probe at both ends and along the edge opposite to vertex i
+    const Vec3f& p = v[(i + 1) % 3];
+    const Vec3f& q = v[(i + 2) % 3];
+    for (int k = 0; k <= 8; ++k) {
+      float t = static_cast<float>(k) / 8.f;
+      mismatches +=
+          CompareEdge(edges[i], static_cast<int>(p.x + (q.x - p.x) * t),
+                      static_cast<int>(p.y + (q.y - p.y) * t));
+    }
+  }
+
+  std::printf("%s: %s path, %d mismatched lanes\n", name,
+              simd ? "SIMD" : "scalar", mismatches);
+  if (mismatches) {
+    ++failures;
+  }
+}
+
+}  // namespace
+
+int main() {
+  // 8192 pixels of guard band around a 800x600 surface
+  const Vec3f small[3] = {Vec3f(-8100.f, -8100.f, 0.f),
+                          Vec3f(-7000.f, -8050.f, 0.f),
+                          Vec3f(-8050.f, -7200.f, 0.f)};
+  CheckTriangle("small in guard band", small, true);
+
+  // Steep edges: one pixel of x per thousands of rows, lane offsets along x
+  // grow with the block width
+  const Vec3f steep[3] = {Vec3f(0.f, -8000.f, 0.f),
+                          Vec3f(1.f, 190.f, 0.f),
+                          Vec3f(-50.f, 0.f, 0.f)};
+  CheckTriangle("steep across guard band", steep, false);
+
+  // Lane offsets just below the saturation with 4 pixel wide blocks
+  const Vec3f steep_short[3] = {Vec3f(400.f, -5000.f, 0.f),
+                                Vec3f(401.f, 300.f, 0.f),
+                                Vec3f(350.f, 0.f, 0.f)};
+  CheckTriangle("steep into guard band", steep_short, false);
+
+  const Vec3f wide[3] = {Vec3f(-8000.f, 300.f, 0.f),
+                         Vec3f(400.f, 280.f, 0.f),
+                         Vec3f(8800.f, 301.f, 0.f)};
+  CheckTriangle("wide across guard band", wide, false);
+
+  // Steep edges on the surface, well inside SIMD range
+  const Vec3f on_surface[3] = {Vec3f(400.f, -600.f, 0.f),
+                               Vec3f(401.f, 600.f, 0.f),
+                               Vec3f(350.f, 0.f, 0.f)};
+  CheckTriangle("steep on surface", on_surface, true);
+
+  return failures ? 1 : 0;
+}